@@ -0,0 +1,177 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1 << 20)
+
+struct arena_chunk {
+  arena_chunk *next;
+  size_t size;
+  alignas(ARENA_ALIGN) char data[];
+};
+
+static inline size_t align_up(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void arena_init(json_arena *arena) { memset(arena, 0, sizeof(*arena)); }
+
+static arena_chunk *arena_new_chunk(size_t size) {
+  arena_chunk *chunk = zmalloc(sizeof(*chunk) + size);
+  if (!chunk) {
+    LOG_ERROR("Failed to allocate arena chunk of %zu bytes", size);
+    return NULL;
+  }
+  chunk->size = size;
+  return chunk;
+}
+
+// Allocations come from the current chunk while they fit. Requests larger
+// than a quarter of the next chunk get a chunk of their own, linked behind
+// the current one so its free space is not abandoned.
+static void *arena_bump(json_arena *arena, size_t size) {
+  size = align_up(size);
+  if (size <= (size_t)(arena->limit - arena->cursor)) {
+    void *ptr = arena->cursor;
+    arena->cursor += size;
+    arena->last = ptr;
+    return ptr;
+  }
+
+  size_t chunk_size = arena->next_chunk_size ? arena->next_chunk_size
+                                             : ARENA_MIN_CHUNK;
+  if (size > chunk_size / 4) {
+    arena_chunk *chunk = arena_new_chunk(size);
+    if (!chunk)
+      return NULL;
+    if (arena->head) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    } else {
+      arena->head = chunk;
+      arena->cursor = arena->limit = chunk->data + size;
+    }
+    return chunk->data;
+  }
+
+  arena_chunk *chunk = arena_new_chunk(chunk_size);
+  if (!chunk)
+    return NULL;
+  chunk->next = arena->head;
+  arena->head = chunk;
+  arena->cursor = chunk->data + size;
+  arena->limit = chunk->data + chunk_size;
+  arena->last = chunk->data;
+  if (chunk_size < ARENA_MAX_CHUNK)
+    arena->next_chunk_size = chunk_size * 2;
+  return chunk->data;
+}
+
+void *arena_alloc(json_arena *arena, size_t size) {
+  if (!arena)
+    return zmalloc(size);
+  return arena_bump(arena, size);
+}
+
+void *arena_calloc(json_arena *arena, size_t count, size_t size) {
+  if (!arena)
+    return zcalloc(count, size);
+  void *ptr = arena_bump(arena, count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+// The most recent allocation is resized in place when the chunk allows it,
+// which keeps growing strings and arrays cheap.
+void *arena_realloc(json_arena *arena, void *ptr, size_t old_size,
+                    size_t new_size) {
+  if (!arena)
+    return zrealloc(ptr, new_size);
+  if (!ptr)
+    return arena_bump(arena, new_size);
+
+  if (ptr == arena->last &&
+      align_up(new_size) <= (size_t)(arena->limit - (char *)ptr)) {
+    arena->cursor = (char *)ptr + align_up(new_size);
+    return ptr;
+  }
+  if (new_size <= old_size)
+    return ptr;
+
+  void *tmp = arena_bump(arena, new_size);
+  if (tmp)
+    memcpy(tmp, ptr, old_size);
+  return tmp;
+}
+
+// Only the most recent allocation can be handed back to an arena; anything
+// else stays until the arena is released.
+void arena_free(json_arena *arena, void *ptr) {
+  if (!arena) {
+    zfree(ptr);
+  } else if (ptr && ptr == arena->last) {
+    arena->cursor = ptr;
+    arena->last = NULL;
+  }
+}
+
+char *arena_strndup(json_arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy)
+    return NULL;
+  memcpy(copy, str, len);
+  copy[len] = 0;
+  return copy;
+}
+
+// Moves every chunk of from into arena, which then owns their allocations.
+// Allocation carries on in the current chunk of arena; from is left empty.
+void arena_adopt(json_arena *arena, json_arena *from) {
+  if (!from->head)
+    return;
+  if (!arena->head) {
+    *arena = *from;
+    arena_init(from);
+    return;
+  }
+  arena_chunk *tail = from->head;
+  while (tail->next)
+    tail = tail->next;
+  tail->next = arena->head->next;
+  arena->head->next = from->head;
+  arena_init(from);
+}
+
+// Forgets every allocation but keeps the newest chunk for reuse, so an arena
+// used as scratch space settles at one chunk.
+void arena_reset(json_arena *arena) {
+  arena_chunk *head = arena->head;
+  if (!head)
+    return;
+  arena_chunk *chunk = head->next;
+  while (chunk) {
+    arena_chunk *next = chunk->next;
+    zfree(chunk);
+    chunk = next;
+  }
+  head->next = NULL;
+  arena->cursor = head->data;
+  arena->limit = head->data + head->size;
+  arena->last = NULL;
+}
+
+void arena_release(json_arena *arena) {
+  arena_chunk *chunk = arena->head;
+  while (chunk) {
+    arena_chunk *next = chunk->next;
+    zfree(chunk);
+    chunk = next;
+  }
+  memset(arena, 0, sizeof(*arena));
+}
@@ -13,69 +13,140 @@ struct array {
   map_value *values;
   uint64_t length;
   uint64_t capacity;
+  json_arena *arena;
 };
 
-array_t *create_array() { return zcalloc(1, sizeof(array_t)); }
+array_t *create_array() { return create_array_in(NULL); }
+
+array_t *create_array_in(json_arena *arena) {
+  array_t *array = arena_calloc(arena, 1, sizeof(array_t));
+  if (array)
+    array->arena = arena;
+  return array;
+}
 
 uint64_t array_length(array_t *array) { return array->length; }
 
+// Drops every element but keeps the storage for reuse.
+void array_clear(array_t *array) { array->length = 0; }
+
 void destroy_array(array_t *array) {
+  if (array->arena)
+    return;
   if (array->capacity > 0)
     zfree(array->values);
   zfree(array);
 }
 
-void array_append_xxx(array_t *array, map_value *value) {
-  if (array->length == array->capacity) {
-    const size_t new_capacity = array->capacity + 8;
+#define ARRAY_MIN_CAPACITY 8
 
-    void *tmp = array->values ? zrealloc(array->values,
-                                         new_capacity * sizeof(*array->values))
-                              : zcalloc(new_capacity, sizeof(*array->values));
+static bool array_resize(array_t *array, uint64_t capacity) {
+  void *tmp = array->values
+                  ? arena_realloc(array->arena, array->values,
+                                  array->capacity * sizeof(*array->values),
+                                  capacity * sizeof(*array->values))
+                  : arena_calloc(array->arena, capacity,
+                                 sizeof(*array->values));
 
-    if (!tmp) {
-      LOG_ERROR("Memory allocation failed");
-      abort();
-    }
+  if (!tmp) {
+    LOG_ERROR("Failed to resize array to %" PRIu64 " elements", capacity);
+    return false;
+  }
+
+  array->values = tmp;
+  array->capacity = capacity;
+  return true;
+}
+
+// Makes room for at least capacity elements without further reallocation.
+bool array_reserve(array_t *array, uint64_t capacity) {
+  if (capacity <= array->capacity)
+    return true;
+  return array_resize(array, capacity);
+}
+
+// Gives back the slack left by geometric growth. In an arena the memory is
+// only reclaimed when the array is the most recent allocation.
+void array_shrink_to_fit(array_t *array) {
+  if (array->length == array->capacity)
+    return;
+  if (!array->length) {
+    arena_free(array->arena, array->values);
+    array->values = NULL;
+    array->capacity = 0;
+    return;
+  }
+  array_resize(array, array->length);
+}
 
-    array->values = tmp;
-    array->capacity = new_capacity;
+// Capacity doubles, so appending n elements copies O(n) elements in total.
+void array_append_xxx(array_t *array, map_value *value) {
+  if (array->length == array->capacity) {
+    uint64_t new_capacity = array->capacity ? array->capacity * 2
+                                            : ARRAY_MIN_CAPACITY;
+    if (!array_resize(array, new_capacity))
+      abort();
   }
 
   memcpy(&array->values[array->length], value, sizeof(*value));
   array->length++;
 }
 
+// Appends every element of from in order with a single copy.
+bool array_append_all(array_t *array, array_t *from) {
+  if (!array_reserve(array, array->length + from->length))
+    return false;
+  if (from->length)
+    memcpy(&array->values[array->length], from->values,
+           from->length * sizeof(*from->values));
+  array->length += from->length;
+  return true;
+}
+
 void array_append_number(array_t *array, double value) {
-  map_value val = {.value.number = value, .type = FLOATS};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, FLOATS, (json_data){.number = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 
 void array_append_bool(array_t *array, bool value) {
-  map_value val = {.value.boolean = value, .type = BOOLEANS};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, BOOLEANS, (json_data){.boolean = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 
 void array_append_ptr(array_t *array, void *value) {
-  map_value val = {.value.ptr = value, .type = POINTER};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, POINTER, (json_data){.ptr = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 void array_append_dict(array_t *array, hash_map *value) {
-  map_value val = {.value.ptr = value, .type = DICT};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, DICT, (json_data){.ptr = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 void array_append_list(array_t *array, array_t *value) {
-  map_value val = {.value.ptr = value, .type = LIST};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, LIST, (json_data){.ptr = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 void array_append_str(array_t *array, char *value) {
-  map_value val = {.value.ptr = value, .type = TEXT};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, TEXT, (json_data){.string = value},
+                     strlen(value), &val))
+    array_append_xxx(array, &val);
 }
 
 void array_append_int(array_t *array, int value) {
-  map_value val = {.value.integer = value, .type = INTEGERS};
-  return array_append_xxx(array, &val);
+  map_value val;
+  if (map_value_make(array->arena, INTEGERS, (json_data){.integer = value},
+                     0, &val))
+    array_append_xxx(array, &val);
 }
 
 int array_get_int(array_t *array, int idx) {
@@ -83,8 +154,7 @@ int array_get_int(array_t *array, int idx) {
     LOG_ERROR("Index %d out of bounds (size: %" PRIu64 ")", idx, array->length);
     return 0;
   }
-  map_value value = array->values[idx];
-  return value.value.integer;
+  return map_value_get_data(&array->values[idx]).integer;
 }
 
 map_value *array_get(array_t *array, int idx) {
@@ -101,8 +171,7 @@ void *array_get_ptr(array_t *array, int idx) {
     LOG_ERROR("Index %d out of bounds (size: %" PRIu64 ")", idx, array->length);
     return NULL;
   }
-  map_value value = array->values[idx];
-  return (void *)value.value.ptr;
+  return map_value_get_data(&array->values[idx]).ptr;
 }
 
 void *array_remove_last_ptr(array_t *array) {
@@ -110,8 +179,7 @@ void *array_remove_last_ptr(array_t *array) {
     LOG_ERROR("Attempted to remove from empty array");
     return NULL;
   }
-  map_value value = array->values[--array->length];
-  return (void *)value.value.ptr;
+  return map_value_get_data(&array->values[--array->length]).ptr;
 }
 
 int array_remove_last_int(array_t *array) {
@@ -119,6 +187,13 @@ int array_remove_last_int(array_t *array) {
     LOG_ERROR("Attempted to remove from empty array");
     return 0;
   }
-  map_value value = array->values[--array->length];
-  return value.value.integer;
+  return map_value_get_data(&array->values[--array->length]).integer;
+}
+
+map_value array_remove_last(array_t *array) {
+  if (array->length == 0) {
+    LOG_ERROR("Attempted to remove from empty array");
+    return (map_value){0};
+  }
+  return array->values[--array->length];
 }
@@ -3,9 +3,97 @@
 
 #include "ison.h"
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk;
+
+// Bump allocator backing a json_document. Functions taking a json_arena
+// pointer fall back to the zot heap when it is NULL.
+typedef struct json_arena {
+  arena_chunk *head;
+  char *cursor;
+  char *limit;
+  void *last;
+  size_t next_chunk_size;
+} json_arena;
+
+// Number kept as its literal until it is first read, with JSON_PARSE_LAZY_
+// NUMBERS. A node holding one has type INTEGERS or FLOATS, value.ptr pointing
+// at the record and length set to the length of the literal; a converted
+// number always has length 0. With NaN-boxing the record also keeps the
+// length and type, and holds integers too wide to box, with length 0.
+// Documents are read concurrently, so the converted value is published
+// through state: only the reader that moves it from PENDING to CONVERTING
+// writes value, and value is read only once state is CONVERTED.
+enum json_lazy_state { LAZY_PENDING, LAZY_CONVERTING, LAZY_CONVERTED };
+
+typedef struct json_lazy_number {
+  const char *text;
+  json_data value;
+  uint32_t length;
+  map_value_type type;
+  atomic_uchar state;
+} json_lazy_number;
+
+size_t json_scan_number(const char *c, const char *end, json_data *value,
+                        map_value_type *type);
+size_t json_span_number(const char *c, const char *end, map_value_type *type);
+
+// Whole file as one read-only buffer: mapped on POSIX systems, read into
+// the heap elsewhere.
+typedef struct json_file_map {
+  char *data;
+  size_t size;
+} json_file_map;
+
+bool json_file_map_open(const char *path, json_file_map *map);
+void json_file_map_close(json_file_map *map);
+
+json_value *json_parse_indexed_value(char *string, char *start, char *end,
+                                     const uint32_t *positions, uint64_t count,
+                                     json_arena *arena, hash_map *keys);
+
+typedef enum json_path_step_kind {
+  PATH_KEY,
+  PATH_INDEX,
+  PATH_WILDCARD
+} json_path_step_kind;
+
+typedef struct json_path_step {
+  json_path_step_kind kind;
+  uint32_t key_len;
+  const char *key;
+  uint64_t index;
+} json_path_step;
+
+// A compiled path is one block: the steps, then the bytes of their keys.
+struct json_path {
+  uint32_t length;
+  bool has_wildcard;
+  json_path_step steps[];
+};
+
+json_value *json_ondemand_project(json_ondemand *doc, json_path *const *paths,
+                                  size_t count, json_arena *arena,
+                                  hash_map *keys);
+
+void arena_init(json_arena *arena);
+void *arena_alloc(json_arena *arena, size_t size);
+void *arena_calloc(json_arena *arena, size_t count, size_t size);
+void *arena_realloc(json_arena *arena, void *ptr, size_t old_size,
+                    size_t new_size);
+void arena_free(json_arena *arena, void *ptr);
+char *arena_strndup(json_arena *arena, const char *str, size_t len);
+void arena_adopt(json_arena *arena, json_arena *from);
+void arena_reset(json_arena *arena);
+void arena_release(json_arena *arena);
 
 array_t *create_array();
+array_t *create_array_in(json_arena *arena);
 uint64_t array_length(array_t *array);
+void array_clear(array_t *array);
+bool array_append_all(array_t *array, array_t *from);
 int array_get_int(array_t *array, int idx);
 void destroy_array(array_t *array);
 void array_append_bool(array_t *array, bool value);
@@ -15,21 +103,58 @@ void array_append_str(array_t *array, char *value);
 void array_append_list(array_t *array, array_t *value);
 void array_append_dict(array_t *array, hash_map *value);
 void array_append_int(array_t *array, int i);
+void array_append_xxx(array_t *array, map_value *value);
+bool array_reserve(array_t *array, uint64_t capacity);
+void array_shrink_to_fit(array_t *array);
 map_value *array_get(array_t *array, int idx);
 int array_get_int(array_t *array, int idx);
 void *array_get_ptr(array_t *array, int idx);
 void *array_remove_last_ptr(array_t *array);
+map_value array_remove_last(array_t *array);
 int array_remove_last_int(array_t *array);
 
+// Canonical copy of an object key in an intern table, with the hash it had
+// when it was interned. The key bytes follow the record, so a map holding
+// str can get back to the record.
+struct json_key {
+  hash_map *table;
+  uint64_t hash;
+  uint32_t len;
+  json_key_hash hash_fn;
+  char str[];
+};
+
+static inline json_key *key_record(const char *key) {
+  return (json_key *)(key - offsetof(json_key, str));
+}
+
+uint64_t compute_hash(json_key_hash hash, const char *string, uint32_t len);
+json_key_hash json_get_key_hash();
+
 hash_map *create_hash_map();
+hash_map *create_hash_map_in(json_arena *arena);
+uint64_t hash_map_length(hash_map *map);
+bool hash_map_reserve(hash_map *map, uint64_t count);
+bool hash_map_add(hash_map *map, char *key, uint32_t key_len,
+                  map_value *value);
+bool hash_map_add_borrowed(hash_map *map, char *key, uint32_t key_len,
+                           map_value *value);
 bool hash_map_add_ptr(hash_map *map, char *key, void *ptr);
 bool hash_map_add_dict(hash_map *map, char *key, hash_map *dict);
 bool hash_map_add_list(hash_map *map, char *key, array_t *list);
-bool hash_map_add_int(hash_map *map, char *key, int integer);
+bool hash_map_add_int(hash_map *map, char *key, int64_t integer);
 bool hash_map_add_bool(hash_map *map, char *key, bool boolean);
 bool hash_map_add_number(hash_map *map, char *key, double d);
 bool hash_map_add_str(hash_map *map, char *key, char *str);
-map_value *hash_map_get(hash_map *map, char *key);
+bool hash_map_add_interned(hash_map *map, json_key *key, map_value *value);
+map_value *hash_map_get(hash_map *map, const char *key, uint32_t key_len);
+map_value *hash_map_get_key(hash_map *map, const json_key *key);
+map_value *hash_map_next_value(hash_map *map, uint64_t *cursor);
+json_key *key_table_find(hash_map *table, const char *key, uint32_t key_len);
+json_key *key_table_intern(hash_map *table, const char *key, uint32_t key_len);
+bool key_table_merge(hash_map *table, hash_map *from);
+bool hash_map_merge(hash_map *map, hash_map *from);
+bool hash_map_rekey(hash_map *map, hash_map *table);
 bool hash_map_replace_number(hash_map *map, char *key, double d);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+// Maps the whole file read-only and tells the kernel it will be read front
+// to back, so read-ahead runs well ahead of the tokenizer.
+bool json_file_map_open(const char *path, json_file_map *map) {
+  memset(map, 0, sizeof(*map));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR("Failed to stat %s: %s", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  // An empty file cannot be mapped; it parses as empty input.
+  if (!st.st_size) {
+    close(fd);
+    return true;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG_ERROR("Failed to map %s: %s", path, strerror(errno));
+    return false;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+  madvise(data, st.st_size, MADV_WILLNEED);
+#endif
+
+  map->data = data;
+  map->size = st.st_size;
+  return true;
+}
+#else
+// Without mmap the file is read into a heap buffer in one go.
+bool json_file_map_open(const char *path, json_file_map *map) {
+  memset(map, 0, sizeof(*map));
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    LOG_ERROR("Failed to open %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  bool read = false;
+  long size;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    map->data = size ? zmalloc(size) : NULL;
+    map->size = size;
+    read = !size || (map->data && fread(map->data, 1, size, f) == (size_t)size);
+  }
+  fclose(f);
+
+  if (!read) {
+    LOG_ERROR("Failed to read %s", path);
+    json_file_map_close(map);
+    return false;
+  }
+  return true;
+}
+#endif
+
+void json_file_map_close(json_file_map *map) {
+  if (map->data) {
+#ifndef _WIN32
+    munmap(map->data, map->size);
+#else
+    zfree(map->data);
+#endif
+  }
+  memset(map, 0, sizeof(*map));
+}
@@ -1,240 +1,571 @@
 #include "ds.h"
 #include "ison_data.h"
-#include <siphash.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <zot.h>
 
-#define HASHMAP_LIMIT 32
-#define HASH_LEN 16
-
-char key[16];
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-void __attribute__((__constructor__)) init() { arc4random_buf(key, 16); }
+// Open addressing in the SwissTable style: one control byte per slot holds
+// either CTRL_EMPTY or the low 7 bits of the slot's hash, and lookups scan a
+// whole group of control bytes at once before touching any slot.
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t)0x80)
+// Grow once the table is more than 7/8 full.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+// Objects with at most SMALL_MAP_MAX keys keep their nodes in a flat array
+// without control bytes and are searched linearly; their keys are only
+// hashed when the map is promoted to a table.
+#define SMALL_MAP_MAX 8
+#define SMALL_MAP_INITIAL 4
+
+// An adaptive map that needs to probe this many groups for an insert is
+// assumed to be under a collision attack and switches to keyed SipHash.
+#define FLOOD_PROBE_GROUPS 8
 
 struct hash_node {
   char *key;
+  uint32_t key_len;
+  uint64_t hash;
   map_value value;
 };
 
+// ctrl is NULL while the map is small; slots then holds size nodes in
+// insertion order and capacity counts allocated nodes. keys is the intern
+// table every key of the map comes from, if there is one; such keys are
+// compared by pointer.
 struct hash_map {
-  hash_node **nodes;
+  int8_t *ctrl;
+  hash_node *slots;
+  uint64_t capacity;
+  uint64_t size;
+  json_arena *arena;
+  hash_map *keys;
+  json_key_hash hash_fn;
 };
 
-hash_map *create_hash_map() {
-  hash_map *map = zmalloc(sizeof(*map));
-  map->nodes = zmalloc(HASHMAP_LIMIT * sizeof(*map->nodes));
+hash_map *create_hash_map() { return create_hash_map_in(NULL); }
+
+// The table itself is allocated on the first insert.
+hash_map *create_hash_map_in(json_arena *arena) {
+  hash_map *map = arena_calloc(arena, 1, sizeof(*map));
+  if (map) {
+    map->arena = arena;
+    map->hash_fn = json_get_key_hash();
+  }
 
   return map;
 }
 
-uint64_t compute_hash(char *string) {
-  uint8_t digest[HASH_LEN];
-  siphash(string, strlen(string), key, digest, HASH_LEN);
-#if (HASH_LEN == 16)
-  uint64_t ms64b = *(uint64_t *)digest;
-  uint64_t ls64b = *(uint64_t *)(digest + 8);
-  uint64_t hash_int = ms64b ^ ls64b;
-#else
-  uint64_t hash_int = *(uint64_t *)digest;
-#endif
+uint64_t hash_map_length(hash_map *map) { return map->size; }
+
+static inline uint64_t map_hash(hash_map *map, const char *key,
+                                uint32_t key_len) {
+  return compute_hash(map->hash_fn, key, key_len);
+}
+
+// An interned key carries the hash it was interned with, which every map
+// using the same hash function can take as is.
+static inline uint64_t key_hash(hash_map *map, const json_key *key) {
+  if (key->hash_fn == map->hash_fn)
+    return key->hash;
+  return map_hash(map, key->str, key->len);
+}
 
-#if (HASHMAP_LIMIT > 0 && (HASHMAP_LIMIT & (HASHMAP_LIMIT - 1)) == 0)
-  // Power-of-two map limit
-  uint64_t index = hash_int & (HASHMAP_LIMIT - 1);
+static inline uint64_t node_hash(hash_map *map, hash_node *node) {
+  if (map->keys)
+    return key_hash(map, key_record(node->key));
+  return map_hash(map, node->key, node->key_len);
+}
+
+static inline int8_t hash_h2(uint64_t hash) { return hash & 0x7f; }
+static inline uint64_t hash_h1(uint64_t hash) { return hash >> 7; }
+
+// Bit i of the result is set when ctrl[i] equals byte.
+static inline uint32_t group_match(const int8_t *ctrl, int8_t byte) {
+#if defined(__SSE2__)
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#elif defined(__ARM_NEON)
+  uint8x16_t eq = vceqq_s8(vld1q_s8(ctrl), vdupq_n_s8(byte));
+  // Narrow each byte to a nibble, then pick one bit per nibble.
+  uint64_t nibbles = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+  nibbles &= 0x1111111111111111ULL;
+  uint32_t mask = 0;
+  while (nibbles) {
+    mask |= 1u << (__builtin_ctzll(nibbles) / 4);
+    nibbles &= nibbles - 1;
+  }
+  return mask;
 #else
-  uint64_t index = hash_int % HASHMAP_LIMIT;
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    mask |= (uint32_t)(ctrl[i] == byte) << i;
+  return mask;
 #endif
+}
 
-  return index;
+// Two keys interned in the same table are equal only if they are the same
+// pointer.
+static inline bool key_equals(hash_node *node, uint64_t hash, const char *key,
+                              uint32_t key_len, bool by_pointer) {
+  if (by_pointer)
+    return node->key == key;
+  return node->hash == hash && node->key_len == key_len &&
+         !memcmp(node->key, key, key_len);
 }
 
-bool hash_map_add(hash_map *map, char *key, map_value *value) {
-  uint32_t key_len = strlen(key) + 1;
-  // Allocate memory for a new hash node (managed by custom GC)
-  hash_node *node = zmalloc(sizeof(*node));
+static inline bool hash_map_is_small(hash_map *map) { return !map->ctrl; }
 
-  // Compute the hash index for the key
-  size_t idx = compute_hash(key);
+static hash_node *small_map_find(hash_map *map, const char *key,
+                                 uint32_t key_len, bool by_pointer) {
+  for (uint64_t i = 0; i < map->size; i++) {
+    hash_node *node = &map->slots[i];
+    if (by_pointer ? node->key == key
+                   : node->key_len == key_len &&
+                         !memcmp(node->key, key, key_len))
+      return node;
+  }
+  return NULL;
+}
 
-  // Check if there is already a node at the computed index
-  if (map->nodes[idx] != NULL) {
-    // If the existing node has a key, it's a direct node, not yet a collision
-    // list
-    if (map->nodes[idx]->key) {
-      // If the key matches the existing node, it's a duplicate
-      if (!strncmp(key, map->nodes[idx]->key, key_len)) {
-        LOG_ERROR("Duplicate key \"%s\". Found '%s'", key,
-                  map->nodes[idx]->key);
-        return false;
-      } else {
-        // Collision detected with a different key that hashed to the same index
-        // Promote the existing node to an array to handle multiple keys
-        hash_node *conflicting_node = map->nodes[idx];
+static hash_node *small_map_append(hash_map *map) {
+  if (map->size == map->capacity) {
+    uint64_t capacity = map->capacity ? map->capacity * 2 : SMALL_MAP_INITIAL;
+    hash_node *slots =
+        arena_realloc(map->arena, map->slots, map->capacity * sizeof(*slots),
+                      capacity * sizeof(*slots));
+    if (!slots) {
+      LOG_ERROR("Failed to grow hash map to %" PRIu64 " nodes", capacity);
+      return NULL;
+    }
+    map->slots = slots;
+    map->capacity = capacity;
+  }
+  return &map->slots[map->size++];
+}
 
-        // Copy the existing node's key and value to the new node
-        node->key = conflicting_node->key;
-        memcpy(&node->value, &conflicting_node->value, sizeof(node->value));
+// Probes group by group (triangular steps over a power-of-two number of
+// groups visit each group once) until the key or an empty slot turns up.
+// Returns the slot holding the key, or NULL with *empty_slot set to the
+// first free slot on the probe sequence and *probes to the groups visited.
+static hash_node *hash_map_find(hash_map *map, uint64_t hash, const char *key,
+                                uint32_t key_len, bool by_pointer,
+                                uint64_t *empty_slot, uint64_t *probes) {
+  if (!map->capacity)
+    return NULL;
 
-        // Mark the original node as a collision holder by nullifying its key
-        conflicting_node->key = NULL;
+  uint64_t group_mask = map->capacity / GROUP_WIDTH - 1;
+  uint64_t group = hash_h1(hash) & group_mask;
+  int8_t h2 = hash_h2(hash);
 
-        // Create a new array to hold nodes with the same hash index
-        array_t *array = create_array();
-        conflicting_node->value.value.ptr = array;
+  for (uint64_t step = 1;; step++) {
+    const int8_t *ctrl = map->ctrl + group * GROUP_WIDTH;
+    for (uint32_t match = group_match(ctrl, h2); match; match &= match - 1) {
+      uint64_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+      if (key_equals(&map->slots[slot], hash, key, key_len, by_pointer))
+        return &map->slots[slot];
+    }
+    uint32_t empty = group_match(ctrl, CTRL_EMPTY);
+    if (empty) {
+      if (empty_slot)
+        *empty_slot = group * GROUP_WIDTH + __builtin_ctz(empty);
+      if (probes)
+        *probes = step;
+      return NULL;
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+// Places a node known to be absent; used while rehashing.
+static void hash_map_place(hash_map *map, hash_node *node) {
+  uint64_t group_mask = map->capacity / GROUP_WIDTH - 1;
+  uint64_t group = hash_h1(node->hash) & group_mask;
+  for (uint64_t step = 1;; step++) {
+    uint32_t empty =
+        group_match(map->ctrl + group * GROUP_WIDTH, CTRL_EMPTY);
+    if (empty) {
+      uint64_t slot = group * GROUP_WIDTH + __builtin_ctz(empty);
+      map->ctrl[slot] = hash_h2(node->hash);
+      map->slots[slot] = *node;
+      return;
+    }
+    group = (group + step) & group_mask;
+  }
+}
 
-        // Add the copied conflicting node to the collision array
-        array_append_ptr(array, node);
+// Moves every node into a table of new_capacity slots. Stored hashes mean no
+// key is hashed again, except when promoting a small map or when the hash
+// function has just changed (rehash_keys); interned keys bring their own.
+static bool hash_map_rehash(hash_map *map, uint64_t new_capacity,
+                            bool rehash_keys) {
+  int8_t *old_ctrl = map->ctrl;
+  hash_node *old_slots = map->slots;
+  uint64_t old_capacity = map->capacity;
+  bool was_small = hash_map_is_small(map);
+
+  int8_t *ctrl = arena_alloc(map->arena, new_capacity);
+  hash_node *slots = arena_alloc(map->arena, new_capacity * sizeof(*slots));
+  if (!ctrl || !slots) {
+    LOG_ERROR("Failed to grow hash map to %" PRIu64 " slots", new_capacity);
+    return false;
+  }
+  memset(ctrl, CTRL_EMPTY, new_capacity);
+
+  map->ctrl = ctrl;
+  map->slots = slots;
+  map->capacity = new_capacity;
+  if (was_small) {
+    for (uint64_t i = 0; i < map->size; i++) {
+      old_slots[i].hash = node_hash(map, &old_slots[i]);
+      hash_map_place(map, &old_slots[i]);
+    }
+  } else {
+    for (uint64_t i = 0; i < old_capacity; i++) {
+      if (old_ctrl[i] == CTRL_EMPTY)
+        continue;
+      if (rehash_keys)
+        old_slots[i].hash = node_hash(map, &old_slots[i]);
+      hash_map_place(map, &old_slots[i]);
+    }
+  }
 
-        // Allocate a new node for the key-value pair being added
-        node = zmalloc(sizeof(*node));
+  if (old_ctrl)
+    arena_free(map->arena, old_ctrl);
+  if (old_slots)
+    arena_free(map->arena, old_slots);
+  return true;
+}
 
-        // Add the new node to the collision array
-        array_append_ptr(array, node);
-      }
-    } else {
-      // Existing node is already a collision array (key is NULL)
+// Sizes the map for count keys up front: a small map gets exactly count
+// nodes, a larger one a table that holds count keys without growing.
+bool hash_map_reserve(hash_map *map, uint64_t count) {
+  if (hash_map_is_small(map) && count <= SMALL_MAP_MAX) {
+    if (count <= map->capacity)
+      return true;
+    hash_node *slots =
+        arena_realloc(map->arena, map->slots, map->capacity * sizeof(*slots),
+                      count * sizeof(*slots));
+    if (!slots) {
+      LOG_ERROR("Failed to grow hash map to %" PRIu64 " nodes", count);
+      return false;
+    }
+    map->slots = slots;
+    map->capacity = count;
+    return true;
+  }
 
-      // Retrieve the collision array from the existing node
-      array_t *array = (void *)map->nodes[idx]->value.value.ptr;
-      uint64_t len = array_length(array);
+  uint64_t capacity = 2 * GROUP_WIDTH;
+  while (count * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM)
+    capacity *= 2;
+  if (!hash_map_is_small(map) && capacity <= map->capacity)
+    return true;
+  return hash_map_rehash(map, capacity, false);
+}
 
-      // Check for duplicate keys within the collision array
-      for (uint64_t i = 0; i < len; i++) {
-        hash_node *existing_node = array_get_ptr(array, i);
+static bool hash_node_fill(hash_map *map, hash_node *node, char *key,
+                           uint32_t key_len, uint64_t hash, map_value *value,
+                           bool copy_key) {
+  node->key = copy_key ? arena_strndup(map->arena, key, key_len) : key;
+  if (!node->key)
+    return false;
+  node->key_len = key_len;
+  node->hash = hash;
+  memcpy(&node->value, value, sizeof(*value));
+  return true;
+}
 
-        if (!strncmp(key, existing_node->key, key_len)) {
-          LOG_ERROR("Duplicate key \"%s\".", key);
-          return false;
-        }
+// interned, when set, is the record of key; the map then keeps comparing
+// keys by pointer for as long as all of them come from the same table.
+static bool hash_map_insert(hash_map *map, char *key, uint32_t key_len,
+                            map_value *value, bool copy_key,
+                            const json_key *interned) {
+  if (!map->size)
+    map->keys = interned ? interned->table : NULL;
+  else if (!interned || map->keys != interned->table)
+    map->keys = NULL;
+  bool by_pointer = map->keys != NULL;
+
+  if (hash_map_is_small(map)) {
+    if (small_map_find(map, key, key_len, by_pointer)) {
+      LOG_ERROR("Duplicate key \"%.*s\".", (int)key_len, key);
+      return false;
+    }
+    if (map->size < SMALL_MAP_MAX) {
+      hash_node *node = small_map_append(map);
+      if (!node)
+        return false;
+      if (!hash_node_fill(map, node, key, key_len, 0, value, copy_key)) {
+        map->size--;
+        return false;
       }
-
-      // No duplicates found, append the new node to the collision array
-      array_append_ptr(array, node);
+      return true;
     }
-  } else {
-    // If no node exists at the hash index, directly insert the new node
-    map->nodes[idx] = node;
+    if (!hash_map_rehash(map, 2 * GROUP_WIDTH, false))
+      return false;
   }
 
-  // Assign the key and copy the value into the new node
-  node->key = zstrdup(key);
-  memcpy(&node->value, value, sizeof(*value));
+  uint64_t hash = interned ? key_hash(map, interned)
+                           : map_hash(map, key, key_len);
+  uint64_t slot;
+  uint64_t probes;
+
+  if (hash_map_find(map, hash, key, key_len, by_pointer, &slot, &probes)) {
+    LOG_ERROR("Duplicate key \"%.*s\".", (int)key_len, key);
+    return false;
+  }
+
+  // Long probe sequences under the fast hash mean the keys collide far more
+  // than chance allows; move the whole map to keyed SipHash for good.
+  if (probes >= FLOOD_PROBE_GROUPS && map->hash_fn == JSON_HASH_ADAPTIVE) {
+    map->hash_fn = JSON_HASH_SIPHASH24;
+    if (!hash_map_rehash(map, map->capacity, true))
+      return false;
+    hash = interned ? key_hash(map, interned) : map_hash(map, key, key_len);
+    hash_map_find(map, hash, key, key_len, by_pointer, &slot, NULL);
+  }
+
+  // Grow before the load factor is exceeded; the free slot found above is
+  // stale after a rehash, so look again.
+  if ((map->size + 1) * MAX_LOAD_DEN > map->capacity * MAX_LOAD_NUM) {
+    if (!hash_map_rehash(map, map->capacity * 2, false))
+      return false;
+    hash_map_find(map, hash, key, key_len, by_pointer, &slot, NULL);
+  }
+
+  if (!hash_node_fill(map, &map->slots[slot], key, key_len, hash, value,
+                      copy_key))
+    return false;
+  map->ctrl[slot] = hash_h2(hash);
+  map->size++;
 
   return true;
 }
 
-bool hash_map_add_ptr(hash_map *map, char *key, void *ptr) {
-  map_value val = {.value.ptr = ptr, .type = POINTER};
-
-  return hash_map_add(map, key, &val);
+bool hash_map_add(hash_map *map, char *key, uint32_t key_len,
+                  map_value *value) {
+  return hash_map_insert(map, key, key_len, value, true, NULL);
 }
-bool hash_map_add_dict(hash_map *map, char *key, hash_map *ptr) {
-  map_value val = {.value.ptr = ptr, .type = DICT};
 
-  return hash_map_add(map, key, &val);
+// Adds the pair without copying the key, which must outlive the map.
+bool hash_map_add_borrowed(hash_map *map, char *key, uint32_t key_len,
+                           map_value *value) {
+  return hash_map_insert(map, key, key_len, value, false, NULL);
 }
-bool hash_map_add_list(hash_map *map, char *key, array_t *list) {
-  map_value val = {.value.ptr = list, .type = LIST};
 
-  return hash_map_add(map, key, &val);
+// Adds the pair under an interned key, reusing its hash and storage.
+bool hash_map_add_interned(hash_map *map, json_key *key, map_value *value) {
+  return hash_map_insert(map, key->str, key->len, value, false, key);
 }
-bool hash_map_add_int(hash_map *map, char *key, int integer) {
-  map_value val = {.value.integer = integer, .type = INTEGERS};
 
-  return hash_map_add(map, key, &val);
+bool hash_map_add_ptr(hash_map *map, char *key, void *ptr) {
+  map_value val;
+  return map_value_make(map->arena, POINTER, (json_data){.ptr = ptr},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
+}
+bool hash_map_add_dict(hash_map *map, char *key, hash_map *ptr) {
+  map_value val;
+  return map_value_make(map->arena, DICT, (json_data){.ptr = ptr},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
+}
+bool hash_map_add_list(hash_map *map, char *key, array_t *list) {
+  map_value val;
+  return map_value_make(map->arena, LIST, (json_data){.ptr = list},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
+}
+bool hash_map_add_int(hash_map *map, char *key, int64_t integer) {
+  map_value val;
+  return map_value_make(map->arena, INTEGERS, (json_data){.integer = integer},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
 }
 bool hash_map_add_bool(hash_map *map, char *key, bool boolean) {
-  {
-    map_value val = {.value.boolean = boolean, .type = BOOLEANS};
-
-    return hash_map_add(map, key, &val);
-  }
+  map_value val;
+  return map_value_make(map->arena, BOOLEANS, (json_data){.boolean = boolean},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
 }
 bool hash_map_add_number(hash_map *map, char *key, double number) {
-  map_value val = {.value.number = number, .type = FLOATS};
-
-  return hash_map_add(map, key, &val);
+  map_value val;
+  return map_value_make(map->arena, FLOATS, (json_data){.number = number},
+                        0, &val) &&
+         hash_map_add(map, key, strlen(key), &val);
 }
 bool hash_map_add_str(hash_map *map, char *key, char *str) {
-  map_value val = {.value.ptr = str, .type = TEXT};
+  map_value val;
+  return map_value_make(map->arena, TEXT, (json_data){.string = str},
+                        strlen(str), &val) &&
+         hash_map_add(map, key, strlen(key), &val);
+}
 
-  return hash_map_add(map, key, &val);
+static hash_node *hash_map_lookup(hash_map *map, const char *key,
+                                  uint32_t key_len) {
+  if (hash_map_is_small(map))
+    return small_map_find(map, key, key_len, false);
+  return hash_map_find(map, map_hash(map, key, key_len), key, key_len, false,
+                       NULL, NULL);
 }
 
-map_value *hash_map_get(hash_map *map, char *key) {
-  // Compute hash index for the key
-  size_t idx = compute_hash(key);
-  hash_node *node = map->nodes[idx];
+map_value *hash_map_get(hash_map *map, const char *key, uint32_t key_len) {
+  hash_node *node = hash_map_lookup(map, key, key_len);
+  return node ? &node->value : NULL;
+}
 
-  // Return NULL immediately if bucket is empty
-  if (node == NULL) {
-    return NULL;
-  }
+// Looks an interned key up without hashing it, and by pointer when the map's
+// keys come from the same table.
+map_value *hash_map_get_key(hash_map *map, const json_key *key) {
+  bool by_pointer = map->keys == key->table;
+  hash_node *node;
+  if (hash_map_is_small(map))
+    node = small_map_find(map, key->str, key->len, by_pointer);
+  else
+    node = hash_map_find(map, key_hash(map, key), key->str, key->len,
+                         by_pointer, NULL, NULL);
+  return node ? &node->value : NULL;
+}
 
-  // Handle single-node bucket
-  if (node->key != NULL) {
-    if (strcmp(node->key, key) == 0) {
-      return &node->value;
-    }
-    return NULL; // Key doesn't match single node
+// Returns the record of key in the intern table, or NULL if it was never
+// interned.
+json_key *key_table_find(hash_map *table, const char *key, uint32_t key_len) {
+  hash_node *node = hash_map_lookup(table, key, key_len);
+  return node ? key_record(node->key) : NULL;
+}
+
+// Returns the canonical record of key, adding a copy of it to the table on
+// first sight.
+json_key *key_table_intern(hash_map *table, const char *key,
+                           uint32_t key_len) {
+  uint64_t hash = 0;
+  hash_node *node;
+  if (hash_map_is_small(table)) {
+    node = small_map_find(table, key, key_len, false);
+  } else {
+    hash = map_hash(table, key, key_len);
+    node = hash_map_find(table, hash, key, key_len, false, NULL, NULL);
   }
+  if (node)
+    return key_record(node->key);
 
-  // Handle collision chain
-  if (node->value.value.ptr != NULL) {
-    array_t *array = node->value.value.ptr;
-    uint64_t len = array_length(array);
+  json_key *record =
+      arena_alloc(table->arena, sizeof(*record) + (size_t)key_len + 1);
+  if (!record) {
+    LOG_ERROR("Failed to intern key \"%.*s\".", (int)key_len, key);
+    return NULL;
+  }
+  record->table = table;
+  record->hash_fn = table->hash_fn;
+  record->hash =
+      hash_map_is_small(table) ? map_hash(table, key, key_len) : hash;
+  record->len = key_len;
+  memcpy(record->str, key, key_len);
+  record->str[key_len] = 0;
+
+  map_value val;
+  if (!map_value_make(table->arena, POINTER, (json_data){.ptr = record}, 0,
+                      &val) ||
+      !hash_map_insert(table, record->str, key_len, &val, false, record))
+    return NULL;
+  return record;
+}
 
-    for (uint64_t i = 0; i < len; i++) {
-      hash_node *chain_node = array_get_ptr(array, i);
-      if (chain_node->key && strcmp(chain_node->key, key) == 0) {
-        return &chain_node->value;
-      }
-    }
+// Steps through the nodes of map: in insertion order while it is small, in
+// slot order once it is a table.
+static hash_node *hash_map_next(hash_map *map, uint64_t *cursor) {
+  bool small = hash_map_is_small(map);
+  uint64_t end = small ? map->size : map->capacity;
+  while (*cursor < end) {
+    uint64_t slot = (*cursor)++;
+    if (small || map->ctrl[slot] != CTRL_EMPTY)
+      return &map->slots[slot];
   }
+  return NULL;
+}
 
-  return NULL; // Key not found in collision chain
+// Steps through the values of map in the same order as hash_map_next; the
+// cursor starts at 0.
+map_value *hash_map_next_value(hash_map *map, uint64_t *cursor) {
+  hash_node *node = hash_map_next(map, cursor);
+  return node ? &node->value : NULL;
 }
 
-bool hash_map_replace(hash_map *map, char *key, map_value *value) {
-  // Compute hash index for the key
-  size_t idx = compute_hash(key);
-  hash_node *node = map->nodes[idx];
+// Interns every key of the intern table from into table.
+bool key_table_merge(hash_map *table, hash_map *from) {
+  uint64_t cursor = 0;
+  hash_node *node;
+  while ((node = hash_map_next(from, &cursor)))
+    if (!key_table_intern(table, node->key, node->key_len))
+      return false;
+  return true;
+}
 
-  // Return NULL immediately if bucket is empty
-  if (node == NULL) {
-    return false;
+// Adds every pair of from to map. Keys are borrowed, so from's storage must
+// live as long as map; keys from an intern table stay interned.
+bool hash_map_merge(hash_map *map, hash_map *from) {
+  uint64_t cursor = 0;
+  hash_node *node;
+  while ((node = hash_map_next(from, &cursor))) {
+    const json_key *interned = from->keys ? key_record(node->key) : NULL;
+    if (!hash_map_insert(map, node->key, node->key_len, &node->value, false,
+                         interned))
+      return false;
   }
+  return true;
+}
 
-  // Handle single-node bucket
-  if (node->key != NULL) {
-    if (strcmp(node->key, key) == 0) {
-      memcpy(&node->value, value, sizeof(*value));
-      return true;
-    }
-    return false; // Key doesn't match single node
+// Points every key of map, which all come from one intern table, at its
+// record in table instead. The keys must already be interned there; their
+// bytes and hashes are unchanged, so no node moves.
+bool hash_map_rekey(hash_map *map, hash_map *table) {
+  if (map->keys == table)
+    return true;
+  if (!map->keys && map->size) {
+    LOG_ERROR("Cannot rekey a map with keys that are not interned");
+    return false;
   }
 
-  // Handle collision chain
-  if (node->value.value.ptr != NULL) {
-    array_t *array = node->value.value.ptr;
-    uint64_t len = array_length(array);
-
-    for (uint64_t i = 0; i < len; i++) {
-      hash_node *chain_node = array_get_ptr(array, i);
-      if (chain_node->key && strcmp(chain_node->key, key) == 0) {
-        memcpy(&chain_node->value, value, sizeof(*value));
-
-        return true;
-      }
+  uint64_t cursor = 0;
+  hash_node *node;
+  while ((node = hash_map_next(map, &cursor))) {
+    json_key *from = key_record(node->key);
+    hash_node *to =
+        hash_map_is_small(table)
+            ? small_map_find(table, from->str, from->len, false)
+            : hash_map_find(table, key_hash(table, from), from->str, from->len,
+                            false, NULL, NULL);
+    if (!to) {
+      LOG_ERROR("Key \"%.*s\" is not interned.", (int)from->len, from->str);
+      return false;
     }
+    node->key = to->key;
   }
+  map->keys = table;
+  return true;
+}
 
-  return false; // Key not found in collision chain
+bool hash_map_replace(hash_map *map, const char *key, uint32_t key_len,
+                      map_value *value) {
+  hash_node *node = hash_map_lookup(map, key, key_len);
+  if (!node)
+    return false;
+  memcpy(&node->value, value, sizeof(*value));
+  return true;
 }
 
 bool hash_map_replace_number(hash_map *map, char *key, double number) {
-  map_value val = {.value.number = number, .type = FLOATS};
-
-  return hash_map_replace(map, key, &val);
+  map_value val;
+  return map_value_make(map->arena, FLOATS, (json_data){.number = number},
+                        0, &val) &&
+         hash_map_replace(map, key, strlen(key), &val);
 }
@@ -1,193 +1,515 @@
 #include "ds.h"
 #include "ison_data.h"
+#include "structural.h"
 #include <errno.h>
 #include <string.h>
+#include <threads.h>
 #include <zot.h>
 
+// Inputs shorter than this are tokenized directly; building a structural
+// index does not pay off for them.
+#define JSON_INDEX_MIN_LENGTH 256
+#define JSON_STRING_INITIAL_SIZE 64
+// Files are read in blocks of this size; the buffer only grows past it for a
+// single token that does not fit.
+#define JSON_STREAM_BLOCK_SIZE (64 * 1024)
+// Inputs smaller than this are parsed on one thread; splitting them costs
+// more than it saves.
+#define JSON_PARALLEL_MIN_LENGTH (1 << 20)
+
+// Parser stacks start with room for this many open containers.
+#define JSON_FRAMES_INITIAL 32
+
+// Under GCC and Clang the automaton dispatches through a table of label
+// addresses, which gives every action its own indirect branch.
+#if defined(__GNUC__) || defined(__clang__)
+#define JSON_COMPUTED_GOTO
+#endif
+
 typedef enum json_token_type json_token_t;
 
 enum json_token_type {
-  NO_TOKEN,
   CURLY_OPEN,
   CURLY_CLOSE,
   SQR_OPEN,
   SQR_CLOSE,
+  COLON,
   COMMA,
   STRING,
-  COLON,
   NUMBER,
-  OBJECT,
-  ARRAY,
+  INTEGER,
   BOOLEAN,
   NIL,
-  VALUE
+  JSON_TOKEN_COUNT
+};
+
+// States of the pushdown automaton that checks the grammar. The container a
+// value goes into is the frame on top of its stack.
+enum json_parse_state {
+  DOC_START,    // expecting the root value
+  DOC_END,      // the root value is complete
+  OBJECT_FIRST, // after '{': a key or '}'
+  OBJECT_KEY,   // after ',' in an object: a key
+  OBJECT_COLON, // after a key: ':'
+  OBJECT_VALUE, // after ':': a value
+  OBJECT_NEXT,  // after a member: ',' or '}'
+  ARRAY_FIRST,  // after '[': a value or ']'
+  ARRAY_VALUE,  // after ',' in an array: a value
+  ARRAY_NEXT,   // after an element: ',' or ']'
+  JSON_STATE_COUNT
+};
+
+enum json_parse_action {
+  REJECT,
+  OPEN_OBJECT,
+  OPEN_ARRAY,
+  CLOSE,
+  ACCEPT_KEY,
+  ACCEPT_COLON,
+  MEMBER_COMMA,
+  ELEMENT_COMMA,
+  ACCEPT_VALUE,
+  JSON_ACTION_COUNT
+};
+
+#define JSON_VALUE_ACTIONS                                                     \
+  [CURLY_OPEN] = OPEN_OBJECT, [SQR_OPEN] = OPEN_ARRAY,                         \
+  [STRING] = ACCEPT_VALUE, [NUMBER] = ACCEPT_VALUE, [INTEGER] = ACCEPT_VALUE,  \
+  [BOOLEAN] = ACCEPT_VALUE, [NIL] = ACCEPT_VALUE
+
+// The action for every state and token; whatever is left out is rejected.
+static const uint8_t json_actions[JSON_STATE_COUNT][JSON_TOKEN_COUNT] = {
+    [DOC_START] = {JSON_VALUE_ACTIONS},
+    [OBJECT_FIRST] = {[CURLY_CLOSE] = CLOSE, [STRING] = ACCEPT_KEY},
+    [OBJECT_KEY] = {[STRING] = ACCEPT_KEY},
+    [OBJECT_COLON] = {[COLON] = ACCEPT_COLON},
+    [OBJECT_VALUE] = {JSON_VALUE_ACTIONS},
+    [OBJECT_NEXT] = {[CURLY_CLOSE] = CLOSE, [COMMA] = MEMBER_COMMA},
+    [ARRAY_FIRST] = {JSON_VALUE_ACTIONS, [SQR_CLOSE] = CLOSE},
+    [ARRAY_VALUE] = {JSON_VALUE_ACTIONS},
+    [ARRAY_NEXT] = {[SQR_CLOSE] = CLOSE, [COMMA] = ELEMENT_COMMA},
+};
+
+static const map_value_type json_token_types[JSON_TOKEN_COUNT] = {
+    [STRING] = TEXT,      [NUMBER] = FLOATS, [INTEGER] = INTEGERS,
+    [BOOLEAN] = BOOLEANS, [NIL] = NULLS,
+};
+
+static const char *const json_token_names[JSON_TOKEN_COUNT] = {
+    [CURLY_OPEN] = "'{'", [CURLY_CLOSE] = "'}'", [SQR_OPEN] = "'['",
+    [SQR_CLOSE] = "']'",  [COLON] = "':'",       [COMMA] = "','",
+    [STRING] = "string",  [NUMBER] = "number",   [INTEGER] = "number",
+    [BOOLEAN] = "boolean", [NIL] = "null",
+};
+
+// Classes of input bytes, so the tokenizer branches once per token on a
+// table lookup instead of through a chain of comparisons.
+enum json_char_class {
+  CHAR_INVALID,
+  CHAR_SPACE,
+  CHAR_NEWLINE,
+  CHAR_STRUCTURAL,
+  CHAR_QUOTE,
+  CHAR_NUMBER,
+  CHAR_LITERAL,
+  CHAR_SLASH
+};
+
+static const uint8_t json_char_classes[256] = {
+    [' '] = CHAR_SPACE,       ['\t'] = CHAR_SPACE,      ['\r'] = CHAR_SPACE,
+    ['\n'] = CHAR_NEWLINE,    ['{'] = CHAR_STRUCTURAL,  ['}'] = CHAR_STRUCTURAL,
+    ['['] = CHAR_STRUCTURAL,  [']'] = CHAR_STRUCTURAL,  [':'] = CHAR_STRUCTURAL,
+    [','] = CHAR_STRUCTURAL,  ['"'] = CHAR_QUOTE,       ['-'] = CHAR_NUMBER,
+    ['0'] = CHAR_NUMBER,      ['1'] = CHAR_NUMBER,      ['2'] = CHAR_NUMBER,
+    ['3'] = CHAR_NUMBER,      ['4'] = CHAR_NUMBER,      ['5'] = CHAR_NUMBER,
+    ['6'] = CHAR_NUMBER,      ['7'] = CHAR_NUMBER,      ['8'] = CHAR_NUMBER,
+    ['9'] = CHAR_NUMBER,      ['n'] = CHAR_LITERAL,     ['t'] = CHAR_LITERAL,
+    ['f'] = CHAR_LITERAL,     ['/'] = CHAR_SLASH,
+};
+
+// The token of each structural character.
+static const uint8_t json_structural_tokens[256] = {
+    ['{'] = CURLY_OPEN, ['}'] = CURLY_CLOSE, ['['] = SQR_OPEN,
+    [']'] = SQR_CLOSE,  [':'] = COLON,       [','] = COMMA,
 };
 
+static inline uint8_t json_char_class(char c) {
+  return json_char_classes[(unsigned char)c];
+}
+
 struct json_value {};
 
-typedef struct token_stream {
-  json_token_t *tokens_array;
-  union json_token_value {
+typedef struct json_token_value {
+  union {
     void *null;
     void *ptr;
     char *string;
-    int integer;
+    int64_t integer;
     double number;
     bool boolean;
-  } *token_values;
-  uint64_t tokens_count;
-  uint64_t next_token_index;
-  uint64_t tokens_capacity;
-  uint64_t values_count;
-  uint64_t next_value_index;
-  uint64_t values_capacity;
-} token_stream;
-
-static inline bool token_stream_append_token(token_stream *tokens,
-                                             json_token_t token) {
-  if (!tokens->tokens_array)
-    tokens->tokens_array =
-        zcalloc(tokens->tokens_capacity = 32, sizeof(*tokens->tokens_array));
-  else if (tokens->tokens_count >= tokens->tokens_capacity) {
-    tokens->tokens_capacity *= 2;
-    void *tmp =
-        zrealloc(tokens->tokens_array,
-                 tokens->tokens_capacity * sizeof(*tokens->tokens_array));
-    if (!tmp) {
-      LOG_ERROR("Failed to allocate %" PRIu64 " bytes for tokens: %s",
-                tokens->tokens_capacity * sizeof(*tokens->tokens_array),
-                strerror(errno));
+  };
+  uint32_t length;
+} json_token_value;
+
+// An open container. Event parsing builds none and only keeps the kind.
+typedef struct json_frame {
+  void *container;
+  bool object;
+} json_frame;
+
+typedef struct json_builder {
+  json_arena *arena;
+  // Open containers, innermost last, and the automaton state.
+  json_frame *frames;
+  uint32_t depth;
+  uint32_t frames_capacity;
+  uint8_t state;
+  hash_map *keys;
+  char *key;
+  uint32_t key_length;
+  json_value *root;
+  // Element count of every container in the order they open, when the
+  // input was pre-scanned.
+  uint32_t *sizes;
+  uint64_t sizes_count;
+  uint64_t container_index;
+  bool insitu;
+  // The input outlives the document but must not be written: strings
+  // without escapes become views into it.
+  bool views;
+  bool lazy_numbers;
+  // Structural index kept by a context between parses, so its buffer is
+  // reused; otherwise one is built and released per parse.
+  json_structural_index *index;
+  // Set for event parsing: values go to the handler and no tree is built.
+  const json_handler *handler;
+  void *handler_ctx;
+} json_builder;
+
+bool parse_json_token(json_builder *builder, json_token_t token,
+                      json_token_value value);
+
+// Position of the tokenizer for error messages. Each thread parses its own
+// input, so each keeps its own position.
+static thread_local int current_line = 0;
+static thread_local int current_column = 0;
+
+static inline int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static bool parse_hex4(char *c, char *end, uint32_t *code) {
+  if (end - c < 4)
+    return false;
+  *code = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hex_digit(c[i]);
+    if (digit < 0)
       return false;
-    }
-    tokens->tokens_array = tmp;
+    *code = *code << 4 | digit;
   }
-  tokens->tokens_array[tokens->tokens_count++] = token;
   return true;
 }
 
-static int current_line = 0;
-static int current_column = 0;
+static int encode_utf8(uint32_t code, char *out) {
+  if (code < 0x80) {
+    out[0] = code;
+    return 1;
+  }
+  if (code < 0x800) {
+    out[0] = 0xc0 | code >> 6;
+    out[1] = 0x80 | (code & 0x3f);
+    return 2;
+  }
+  if (code < 0x10000) {
+    out[0] = 0xe0 | code >> 12;
+    out[1] = 0x80 | (code >> 6 & 0x3f);
+    out[2] = 0x80 | (code & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | code >> 18;
+  out[1] = 0x80 | (code >> 12 & 0x3f);
+  out[2] = 0x80 | (code >> 6 & 0x3f);
+  out[3] = 0x80 | (code & 0x3f);
+  return 4;
+}
+
+// Decodes the escape sequence whose backslash is at *pos into out and leaves
+// *pos on its last character. Returns the number of bytes written, which
+// never exceeds the length of the sequence, or 0 if it is invalid.
+static int decode_json_escape(char **pos, char *end, char *out) {
+  char *c = *pos + 1;
+  current_column++;
+  int written = 1;
+  switch (c < end ? *c : 0) {
+  case 'n':
+    *out = '\n';
+    break;
+  case '\\':
+    *out = '\\';
+    break;
+  case '/':
+    *out = '/';
+    break;
+  case '"':
+    *out = '"';
+    break;
+  case 'r':
+    *out = '\r';
+    break;
+  case 't':
+    *out = '\t';
+    break;
+  case 'b':
+    *out = '\b';
+    break;
+  case 'f':
+    *out = '\f';
+    break;
+
+  case 'u': {
+    uint32_t code;
+    if (!parse_hex4(c + 1, end, &code)) {
+      LOG_ERROR("Invalid \\u escape at line %d column %d.", current_line,
+                current_column);
+      return 0;
+    }
+    c += 4;
+    current_column += 4;
+    // A high surrogate must be followed by an escaped low surrogate.
+    if (code >= 0xd800 && code < 0xdc00) {
+      uint32_t low;
+      if (end - c < 3 || c[1] != '\\' || c[2] != 'u' ||
+          !parse_hex4(c + 3, end, &low) || low < 0xdc00 || low >= 0xe000) {
+        LOG_ERROR("Unpaired surrogate at line %d column %d.", current_line,
+                  current_column);
+        return 0;
+      }
+      code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+      c += 6;
+      current_column += 6;
+    }
+    written = encode_utf8(code, out);
+  } break;
+  default:
+    LOG_ERROR("Invalid escape sequence \\%c at line %d column %d.",
+              c < end ? *c : ' ', current_line, current_column);
+    return 0;
+  }
+  *pos = c;
+  return written;
+}
+
+static inline void string_too_long() {
+  LOG_ERROR("String longer than %" PRIu32 " bytes at line %d column %d.",
+            UINT32_MAX - 8, current_line, current_column);
+}
 
-bool parse_json_string_literal(char **pos, char **json_string,
-                               uint32_t *buf_size) {
+bool parse_json_string_literal(char **pos, char *end, json_arena *arena,
+                               char **json_string, uint32_t *buf_size,
+                               uint32_t *length) {
   uint32_t len = 0;
   char *c = *pos;
   while (true) {
-    if (len >= *buf_size - 1) {
-      *buf_size *= 2;
-      char *tmp = zrealloc(*json_string, *buf_size);
+    // Copy everything up to the next quote, backslash or control character
+    // in one go; only those need a closer look.
+    size_t run = json_scan_string_run(c, end);
+    if (run > UINT32_MAX - 8 - len) {
+      string_too_long();
+      return false;
+    }
+    if (len + run + 5 > *buf_size) {
+      uint32_t old_size = *buf_size;
+      while (len + run + 5 > *buf_size)
+        *buf_size = *buf_size > UINT32_MAX / 2 ? UINT32_MAX : *buf_size * 2;
+      char *tmp = arena_realloc(arena, *json_string, old_size, *buf_size);
       if (!tmp) {
         LOG_ERROR("String allocation failed");
         return false;
       }
       *json_string = tmp;
     }
+    memcpy(*json_string + len, c, run);
+    len += run;
+    c += run;
+    current_column += run;
+
+    if (c >= end) {
+      LOG_ERROR("Unterminated string at line %d column %d.", current_line,
+                current_column);
+      return false;
+    }
+
     switch (*c) {
     case '\\': {
-      c++;
-      char escape;
-      switch (*c) {
-      case 'n':
-        escape = '\n';
-        break;
-      case '\\':
-        escape = '\\';
-        break;
-      case '"':
-        escape = '"';
-        break;
-      case 'r':
-        escape = '\r';
-        break;
-      case 't':
-        escape = '\t';
-        break;
-      case 'b':
-        escape = '\b';
-        break;
-      case 'f':
-        escape = '\f';
-        break;
-
-      case 'u':
-        c++;
-        escape = (char)strtol((char[]){c[0], c[1], c[2], c[3], 0}, NULL, 16);
-        c += 3;
-        current_column += 4;
-
-        break;
-      default:
-        LOG_ERROR("Invalid escape sequence \\%c at line %d column %d.", *c,
-                  current_line, current_column);
+      int written = decode_json_escape(&c, end, *json_string + len);
+      if (!written)
         return false;
-      }
-      **json_string = escape;
-      (*json_string)++;
-    }; break;
+      len += written;
+    } break;
     case '"':
+      (*json_string)[len] = 0;
+      *length = len;
       *pos = c;
       return true;
       break;
     default:
-      (*json_string)[len++] = *c;
+      LOG_ERROR("Unescaped control character in string at line %d column %d.",
+                current_line, current_column);
+      return false;
     }
     c++;
+    current_column++;
   }
 }
 
-static inline bool token_stream_append_value(token_stream *tokens, char *string,
-                                             void *ptr, bool boolean,
-                                             double number,
-                                             json_token_t token) {
-  if (!tokens->token_values) {
-    tokens->token_values =
-        zcalloc(tokens->values_capacity = 32, sizeof(*tokens->token_values));
-  } else if (tokens->values_count >= tokens->values_capacity) {
-    tokens->values_capacity *= 2;
-    void *tmp =
-        zrealloc(tokens->token_values,
-                 tokens->values_capacity * sizeof(*tokens->token_values));
-    if (!tmp) {
-      fprintf(stderr, "Failed to allocate memory for values.\n");
+// Points *json_string into the input when the literal at *pos has no escapes,
+// so nothing is copied or written; such a view is not NUL-terminated. A
+// literal with escapes is decoded into the arena instead.
+static bool parse_json_string_view(char **pos, char *end, json_arena *arena,
+                                   char **json_string, uint32_t *length) {
+  char *c = *pos;
+  c += json_scan_string_run(c, end);
+  if (c < end && *c == '"') {
+    if ((size_t)(c - *pos) > UINT32_MAX - 8) {
+      string_too_long();
       return false;
     }
-    tokens->token_values = tmp;
-  }
-  switch (token) {
-  case STRING:
-    tokens->token_values[tokens->values_count++].string = string;
-    break;
-  case OBJECT:
-    tokens->token_values[tokens->values_count++].ptr = ptr;
-    break;
-  case ARRAY:
-    tokens->token_values[tokens->values_count++].ptr = ptr;
-    break;
-  case BOOLEAN:
-    tokens->token_values[tokens->values_count++].boolean = boolean;
-    break;
-  case NUMBER:
-    tokens->token_values[tokens->values_count++].number = number;
-    break;
-  default:
-    break;
+    current_column += c - *pos;
+    *json_string = *pos;
+    *length = c - *pos;
+    *pos = c;
+    return true;
   }
+
+  uint32_t buffsize = JSON_STRING_INITIAL_SIZE;
+  *json_string = arena_alloc(arena, buffsize);
+  if (!*json_string || !parse_json_string_literal(pos, end, arena, json_string,
+                                                  &buffsize, length))
+    return false;
+  char *tmp = arena_realloc(arena, *json_string, buffsize, *length + 1);
+  if (tmp)
+    *json_string = tmp;
   return true;
 }
 
+// Unescapes the string starting at *pos inside the input buffer itself. The
+// decoded text never outgrows the literal, so the terminator fits where the
+// closing quote was.
+bool parse_json_string_insitu(char **pos, char *end, char **json_string,
+                              uint32_t *length) {
+  char *c = *pos;
+  char *dest = c;
+  *json_string = dest;
+  while (true) {
+    size_t run = json_scan_string_run(c, end);
+    if (dest != c)
+      memmove(dest, c, run);
+    dest += run;
+    c += run;
+    current_column += run;
+
+    if (c >= end) {
+      LOG_ERROR("Unterminated string at line %d column %d.", current_line,
+                current_column);
+      return false;
+    }
+
+    switch (*c) {
+    case '\\': {
+      int written = decode_json_escape(&c, end, dest);
+      if (!written)
+        return false;
+      dest += written;
+    } break;
+    case '"':
+      if (dest - *json_string > UINT32_MAX - 8) {
+        string_too_long();
+        return false;
+      }
+      *dest = 0;
+      *length = dest - *json_string;
+      *pos = c;
+      return true;
+    default:
+      LOG_ERROR("Unescaped control character in string at line %d column %d.",
+                current_line, current_column);
+      return false;
+    }
+    c++;
+    current_column++;
+  }
+}
+
 void static inline invalid_number() {
   LOG_ERROR("Invalid number format at line %d column %d.", current_line,
             current_column);
 }
 
-bool parse_json_number_literal(char **pos, double *number) {
-  char *endptr;
-  *number = strtod(*pos, &endptr);
-  if (endptr == *pos || errno == ERANGE) {
+// Sets *token to INTEGER or NUMBER depending on the literal's form.
+bool parse_json_number_literal(char **pos, char *end, json_token_t *token,
+                               json_token_value *value) {
+  json_data data;
+  map_value_type type;
+  size_t consumed = json_scan_number(*pos, end, &data, &type);
+  if (!consumed) {
+    invalid_number();
+    return false;
+  }
+
+  if (type == INTEGERS) {
+    *token = INTEGER;
+    value->integer = data.integer;
+  } else {
+    *token = NUMBER;
+    value->number = data.number;
+  }
+  current_column += consumed;
+  *pos += consumed;
+  return true;
+}
+
+// Validates the literal but leaves converting it to the first read. The
+// record keeps its text: a copy in the arena, or the input itself in situ.
+static bool parse_json_lazy_number(char **pos, char *end, json_builder *builder,
+                                   json_token_t *token,
+                                   json_token_value *value) {
+  map_value_type type;
+  size_t span = json_span_number(*pos, end, &type);
+  if (!span || span > UINT32_MAX) {
     invalid_number();
     return false;
   }
-  *pos = endptr;
+
+  bool borrow = builder->insitu || builder->views;
+  size_t text_size = borrow ? 0 : span;
+  json_lazy_number *lazy =
+      arena_alloc(builder->arena, sizeof(*lazy) + text_size);
+  if (!lazy) {
+    LOG_ERROR("Failed to allocate number");
+    return false;
+  }
+  if (borrow) {
+    lazy->text = *pos;
+  } else {
+    memcpy(lazy + 1, *pos, span);
+    lazy->text = (const char *)(lazy + 1);
+  }
+  lazy->length = span;
+  lazy->type = type;
+  atomic_init(&lazy->state, LAZY_PENDING);
+
+  *token = type == INTEGERS ? INTEGER : NUMBER;
+  value->ptr = lazy;
+  value->length = span;
+  current_column += span;
+  *pos += span;
   return true;
 }
 
@@ -196,575 +518,1633 @@ void static inline invalid_char() {
             current_column);
 }
 
-bool tokenize_json_string(char *string, token_stream *tokens) {
-  current_line++;
-  current_column = 0;
-  char *c = string;
-  while (true) {
-    switch (*c) {
-    case '{':
-      token_stream_append_token(tokens, CURLY_OPEN);
-      break;
-    case '}':
-      token_stream_append_token(tokens, CURLY_CLOSE);
-      break;
-    case '[':
-      token_stream_append_token(tokens, SQR_OPEN);
-      break;
-    case ']':
-      token_stream_append_token(tokens, SQR_CLOSE);
-      break;
-    case ':':
-      token_stream_append_token(tokens, COLON);
-      break;
-    case ',':
-      token_stream_append_token(tokens, COMMA);
-      break;
-    case '"': {
-      token_stream_append_token(tokens, STRING);
-      uint32_t buffsize = 4096;
-      char *json_string = zcalloc(1, buffsize);
+// Tokenizes the single token starting at *pos and advances past it.
+static bool tokenize_json_token(char **pos, char *end, json_builder *builder) {
+  char *c = *pos;
+  switch (json_char_class(*c)) {
+  case CHAR_STRUCTURAL:
+    if (!parse_json_token(builder, json_structural_tokens[(unsigned char)*c],
+                          (json_token_value){}))
+      return false;
+    break;
+  case CHAR_QUOTE: {
+    if (builder->insitu || builder->views) {
+      char *json_string;
+      uint32_t length;
       c++;
       current_column++;
-      if (!parse_json_string_literal(&c, &json_string, &buffsize))
-        return false;
-      token_stream_append_value(tokens, json_string, NULL, false, 0, STRING);
-      zrealloc(json_string, strlen(json_string) + 1);
-    } break;
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-    case '+':
-    case '-': {
-      token_stream_append_token(tokens, NUMBER);
-      double number;
-      if (!parse_json_number_literal(&c, &number))
+      if (!(builder->insitu
+                ? parse_json_string_insitu(&c, end, &json_string, &length)
+                : parse_json_string_view(&c, end, builder->arena, &json_string,
+                                         &length)) ||
+          !parse_json_token(
+              builder, STRING,
+              (json_token_value){.string = json_string, .length = length}))
         return false;
+      break;
+    }
+    uint32_t buffsize = JSON_STRING_INITIAL_SIZE;
+    char *json_string = arena_alloc(builder->arena, buffsize);
+    if (!json_string) {
+      LOG_ERROR("Failed to allocate string buffer");
+      return false;
+    }
+    c++;
+    current_column++;
+    uint32_t length;
+    if (!parse_json_string_literal(&c, end, builder->arena, &json_string,
+                                   &buffsize, &length)) {
+      arena_free(builder->arena, json_string);
+      return false;
+    }
+    char *tmp =
+        arena_realloc(builder->arena, json_string, buffsize, length + 1);
+    if (tmp)
+      json_string = tmp;
+    if (!parse_json_token(
+            builder, STRING,
+            (json_token_value){.string = json_string, .length = length}))
+      return false;
+  } break;
+  case CHAR_NUMBER: {
+    json_token_t token;
+    json_token_value value = {};
+    if (builder->lazy_numbers
+            ? !parse_json_lazy_number(&c, end, builder, &token, &value)
+            : !parse_json_number_literal(&c, end, &token, &value))
+      return false;
 
-      token_stream_append_value(tokens, NULL, NULL, false, number, NUMBER);
-      continue;
+    *pos = c;
+    return parse_json_token(builder, token, value);
+  }
+  case CHAR_LITERAL: {
+    // null, true and false are told apart by their first letter.
+    const char *word = *c == 'n' ? "null" : *c == 't' ? "true" : "false";
+    int length = *c == 'f' ? 5 : 4;
+    if (end - c < length || memcmp(c, word, length)) {
+      invalid_char();
+      return false;
+    }
+    c += length - 1;
+    current_column += length - 1;
+    if (!parse_json_token(builder, *word == 'n' ? NIL : BOOLEAN,
+                          (json_token_value){.boolean = *word == 't'}))
+      return false;
+  } break;
+  case CHAR_SLASH:
+    if (c + 1 >= end || c[1] != '/') {
+      current_column++;
+      invalid_char();
+      return false;
+    }
+    while (c + 1 < end && c[1] != '\n')
+      c++;
 
-    } break;
-    case 'n':
-      if (c[1] == 'u' && c[2] == 'l' && c[3] == 'l') {
-        token_stream_append_token(tokens, NIL);
-        c += 3;
-        current_column += 3;
-      } else {
-        invalid_char();
-        return false;
-      }
-      break;
-    case 't':
-      if (c[1] == 'r' && c[2] == 'u' && c[3] == 'e') {
-        token_stream_append_token(tokens, BOOLEAN);
-        c += 3;
-        current_column += 3;
-      } else {
-        invalid_char();
-        return false;
-      }
-      token_stream_append_value(tokens, NULL, NULL, true, 0, BOOLEAN);
-      break;
-    case 'f':
-      if (c[1] == 'a' && c[2] == 'l' && c[3] == 's' && c[4] == 'e') {
-        token_stream_append_token(tokens, BOOLEAN);
-        c += 4;
-        current_column += 4;
-      } else {
-        invalid_char();
-        return false;
-      }
-      token_stream_append_value(tokens, NULL, NULL, false, 0, BOOLEAN);
-      break;
-    case '/':
-      if (c[1] != '/') {
-        current_column++;
-        invalid_char();
-      }
-      while (c[1] != '\n')
-        c++;
+    break;
+  default:
+    invalid_char();
+    return false;
+  }
+  *pos = c + 1;
+  current_column++;
+  return true;
+}
 
+// Advances over whitespace up to limit while keeping the line and column
+// counters current. Anything else found on the way is an error.
+static bool skip_json_whitespace(char **pos, char *limit) {
+  for (char *c = *pos; c < limit; c++) {
+    switch (json_char_class(*c)) {
+    case CHAR_NEWLINE:
+      current_line++;
+      current_column = 0;
       break;
-    case ' ':
-    case '\r':
-    case '\n':
-    case '\t':
+    case CHAR_SPACE:
+      current_column++;
       break;
     default:
+      *pos = c;
       invalid_char();
       return false;
     }
-    c++;
-    current_column++;
-    if ((int)*c == EOF || *c == 0) {
+  }
+  *pos = limit;
+  return true;
+}
+
+// Tells whether the token starting at c ends before end. A token that runs
+// into end may continue in the next block of a stream.
+static bool json_token_complete(const char *c, const char *end) {
+  switch (json_char_class(*c)) {
+  case CHAR_QUOTE:
+    for (c++; c < end; c++) {
+      c += json_scan_string_run(c, end);
+      if (c >= end)
+        return false;
+      if (*c == '"')
+        return true;
+      if (*c == '\\' && ++c == end)
+        return false;
+    }
+    return false;
+  case CHAR_LITERAL:
+    return end - c > (*c == 'f' ? 5 : 4);
+  case CHAR_SLASH:
+    return end - c > 1 && (c[1] != '/' || memchr(c, '\n', end - c));
+  case CHAR_NUMBER:
+    while (c < end && ((*c >= '0' && *c <= '9') || *c == '-' || *c == '+' ||
+                       *c == '.' || *c == 'e' || *c == 'E'))
+      c++;
+    return c < end;
+  default:
+    return true;
+  }
+}
+
+// Tokenizes from *pos up to end. Unless this is the last chunk of the input,
+// it stops at a token that end cuts off and leaves *pos on its first byte.
+static bool tokenize_json_chunk(char **pos, char *end, json_builder *builder,
+                                bool last) {
+  char *c = *pos;
+  while (c < end) {
+    switch (json_char_class(*c)) {
+    case CHAR_NEWLINE:
+      current_line++;
+      current_column = 0;
+      c++;
       break;
+    case CHAR_SPACE:
+      current_column++;
+      c++;
+      break;
+    default:
+      if (!last && !json_token_complete(c, end)) {
+        *pos = c;
+        return true;
+      }
+      if (!tokenize_json_token(&c, end, builder))
+        return false;
     }
   }
+  *pos = c;
   return true;
 }
 
-static inline json_token_t token_stream_pop(token_stream *tokens) {
-  return tokens->tokens_array[tokens->next_token_index++];
+bool tokenize_json_string(char *string, size_t length, json_builder *builder) {
+  return tokenize_json_chunk(&string, string + length, builder, true);
 }
-static inline json_token_t token_stream_peek(token_stream *tokens) {
-  return tokens->tokens_array[tokens->next_token_index];
+
+// Drives the tokenizer over [c, end) from the count index positions that
+// fall in it, so only token starts are visited; the bytes skipped in between
+// must be whitespace.
+static bool tokenize_json_range(char *string, char *c, char *end,
+                                const uint32_t *positions, uint64_t count,
+                                json_builder *builder) {
+  for (uint64_t i = 0; i < count; i++) {
+    char *next = string + positions[i];
+    if (next < c)
+      continue;
+    if (!skip_json_whitespace(&c, next) ||
+        !tokenize_json_token(&c, end, builder))
+      return false;
+  }
+  return skip_json_whitespace(&c, end);
 }
-static inline union json_token_value
-token_stream_pop_value(token_stream *tokens) {
-  return tokens->token_values[tokens->next_value_index++];
+
+static bool tokenize_json_indexed(char *string, size_t length,
+                                  json_structural_index *index,
+                                  json_builder *builder) {
+  return tokenize_json_range(string, string, string + length,
+                             index->positions, index->count, builder);
 }
 
-bool state_stack_push(array_t *states, json_token_t token) {
-  array_append_int(states, token);
+// Counts the elements of every container from count structural positions
+// alone: a container holds one more element than it has commas at its own
+// depth, unless nothing follows its opening bracket before it closes. When
+// framed, the first and last positions stand for the brackets of the
+// outermost container whatever their bytes, as the cuts around a share do.
+// The counts only size allocations, so malformed input merely gets poor
+// estimates.
+static bool json_count_elements(const char *string, const uint32_t *positions,
+                                uint64_t count, bool framed,
+                                json_builder *builder) {
+  if (!count)
+    return true;
+  uint32_t *sizes = zmalloc(count * sizeof(*sizes));
+  uint32_t *open = zmalloc(count * sizeof(*open));
+  if (!sizes || !open) {
+    LOG_ERROR("Failed to allocate container sizes");
+    zfree(sizes);
+    zfree(open);
+    return false;
+  }
+
+  uint64_t containers = 0;
+  uint64_t depth = 0;
+  bool fresh = false;
+  for (uint64_t i = 0; i < count; i++) {
+    char c = string[positions[i]];
+    if (framed && (!i || i + 1 == count))
+      c = i ? ']' : '[';
+    if (c == '}' || c == ']') {
+      if (depth)
+        depth--;
+      fresh = false;
+      continue;
+    }
+    if (fresh)
+      sizes[open[depth - 1]] = 1;
+    fresh = false;
+    if (c == '{' || c == '[') {
+      sizes[containers] = 0;
+      open[depth++] = containers++;
+      fresh = true;
+    } else if (c == ',' && depth) {
+      sizes[open[depth - 1]]++;
+    }
+  }
+  zfree(open);
+
+  builder->sizes = sizes;
+  builder->sizes_count = containers;
   return true;
 }
 
-json_token_t state_stack_peek_n(array_t *states, int n) {
-  auto states_length = array_length(states);
-  if (array_length(states) < n)
-    return 0;
-  return states_length ? array_get_int(states, states_length - n) : NO_TOKEN;
+static bool tokenize_json_buffer(char *string, size_t length,
+                                 json_builder *builder, bool presize) {
+  if (length < JSON_INDEX_MIN_LENGTH || length > UINT32_MAX)
+    return tokenize_json_string(string, length, builder);
+
+  json_structural_index own = {0};
+  json_structural_index *index = builder->index ? builder->index : &own;
+  bool tokenized;
+  if (!json_structural_index_build(string, length, index) ||
+      index->has_comments) {
+    tokenized = tokenize_json_string(string, length, builder);
+  } else {
+    if (presize)
+      json_count_elements(string, index->positions, index->count, false,
+                          builder);
+    tokenized = tokenize_json_indexed(string, length, index, builder);
+  }
+  json_structural_index_release(&own);
+  return tokenized;
 }
 
-json_token_t state_stack_peek(array_t *states) {
-  return state_stack_peek_n(states, 1);
+// Frames grow geometrically and a reused builder keeps them, so nesting
+// costs no allocation once the stack has been deep enough.
+static bool json_builder_push(json_builder *builder, void *container,
+                              bool object) {
+  if (builder->depth == builder->frames_capacity) {
+    uint32_t capacity = builder->frames_capacity
+                            ? builder->frames_capacity * 2
+                            : JSON_FRAMES_INITIAL;
+    json_frame *frames =
+        zrealloc(builder->frames, capacity * sizeof(*frames));
+    if (!frames) {
+      LOG_ERROR("Failed to grow parser stack to %" PRIu32 " frames",
+                capacity);
+      return false;
+    }
+    builder->frames = frames;
+    builder->frames_capacity = capacity;
+  }
+  builder->frames[builder->depth++] =
+      (json_frame){.container = container, .object = object};
+  return true;
 }
 
-json_token_t state_stack_pop(array_t *states) {
-  auto states_length = array_length(states);
+// Readies a builder for another document. Its frame stack is emptied but
+// keeps the capacity it has grown to.
+static bool json_builder_reuse(json_builder *builder, json_arena *arena) {
+  json_frame *frames = builder->frames;
+  uint32_t frames_capacity = builder->frames_capacity;
+  zfree(builder->sizes);
+  memset(builder, 0, sizeof(*builder));
+  builder->arena = arena;
+  builder->frames = frames;
+  builder->frames_capacity = frames_capacity;
+  builder->state = DOC_START;
+  builder->root = arena_calloc(arena, 1, sizeof(*builder->root));
+  return builder->root != NULL;
+}
 
-  if (!states_length)
-    return NO_TOKEN;
-  auto state = array_remove_last_int(states);
-  return state;
+static bool json_builder_init(json_builder *builder, json_arena *arena) {
+  memset(builder, 0, sizeof(*builder));
+  return json_builder_reuse(builder, arena);
 }
 
-void root_stack_push(array_t *root_list, void *root) {
-  return array_append_ptr(root_list, root);
+static void json_builder_release(json_builder *builder) {
+  zfree(builder->sizes);
+  zfree(builder->frames);
 }
 
-void *root_stack_pop(array_t *root_list) {
-  auto root_list_length = array_length(root_list);
+// A lazy number comes with the length of its literal and its record.
+static bool json_map_value(json_builder *builder, map_value_type type,
+                           json_token_value value, map_value *val) {
+  json_data data = {0};
+  uint32_t length = 0;
+  switch (type) {
+  case TEXT:
+    data.string = value.string;
+    length = value.length;
+    break;
+  case INTEGERS:
+  case FLOATS:
+    if (value.length) {
+      data.ptr = value.ptr;
+      length = value.length;
+    } else if (type == INTEGERS) {
+      data.integer = value.integer;
+    } else {
+      data.number = value.number;
+    }
+    break;
+  case BOOLEANS:
+    data.boolean = value.boolean;
+    break;
+  default:
+    data.ptr = value.ptr;
+    break;
+  }
+  return map_value_make(builder->arena, type, data, length, val);
+}
 
-  if (!root_list_length)
-    return NULL;
-  auto root = array_remove_last_ptr(root_list);
-  return root;
+// Hands a key to the event handler. Its text may live in the scratch arena,
+// which is emptied as soon as the callback returns.
+static bool emit_json_key(json_builder *builder, json_token_value key) {
+  const json_handler *handler = builder->handler;
+  bool resume =
+      !handler->key || handler->key(builder->handler_ctx, key.string,
+                                    key.length);
+  arena_reset(builder->arena);
+  return resume;
 }
 
-void key_stack_push(array_t *key_list, char *key) {
-  return array_append_str(key_list, key);
+// Reports a scalar to the event handler in place of inserting it.
+static bool emit_json_value(json_builder *builder, map_value_type type,
+                            json_token_value value) {
+  const json_handler *handler = builder->handler;
+  void *ctx = builder->handler_ctx;
+  switch (type) {
+  case TEXT: {
+    bool resume =
+        !handler->string || handler->string(ctx, value.string, value.length);
+    arena_reset(builder->arena);
+    return resume;
+  }
+  case INTEGERS:
+    return !handler->integer || handler->integer(ctx, value.integer);
+  case FLOATS:
+    return !handler->number || handler->number(ctx, value.number);
+  case BOOLEANS:
+    return !handler->boolean || handler->boolean(ctx, value.boolean);
+  case NULLS:
+    return !handler->null || handler->null(ctx);
+  default:
+    return true;
+  }
 }
 
-char *key_stack_pop(array_t *key_list) {
-  auto root_list_length = array_length(key_list);
+// Stores a value in the container on top of the stack, under the pending key
+// if that is an object, or makes it the document root.
+static bool insert_json_value(json_builder *builder, map_value_type type,
+                              json_token_value value) {
+  if (builder->handler)
+    return emit_json_value(builder, type, value);
 
-  if (!root_list_length)
-    return NULL;
-  auto root = array_remove_last_ptr(key_list);
-  return root;
-}
+  map_value val;
+  if (!json_map_value(builder, type, value, &val))
+    return false;
+  if (!builder->depth) {
+    *builder->root = val;
+    return true;
+  }
+
+  json_frame *frame = &builder->frames[builder->depth - 1];
+  if (!frame->object) {
+    array_append_xxx(frame->container, &val);
+    return true;
+  }
 
-void list_stack_push(array_t *list_list, void *list) {
-  return array_append_ptr(list_list, list);
+  // Documents intern every key, in situ parses included, so the map points
+  // at the key table's copy. Without a table, keys parsed into an arena or
+  // left as views into a buffer that outlives the map are borrowed instead
+  // of copied.
+  hash_map *map = frame->container;
+  if (builder->keys) {
+    if (!hash_map_add_interned(map, key_record(builder->key), &val))
+      return false;
+  } else if (builder->arena) {
+    if (!hash_map_add_borrowed(map, builder->key, builder->key_length, &val))
+      return false;
+  } else {
+    if (!hash_map_add(map, builder->key, builder->key_length, &val))
+      return false;
+    zfree(builder->key);
+  }
+  builder->key = NULL;
+  return true;
 }
 
-void *list_stack_pop(array_t *list_list) {
-  auto list_list_length = array_length(list_list);
+// Returns the pre-scanned element count of the container being opened, or 0
+// when there is none.
+static uint32_t json_builder_next_size(json_builder *builder) {
+  if (!builder->sizes)
+    return 0;
+  uint64_t index = builder->container_index++;
+  return index < builder->sizes_count ? builder->sizes[index] : 0;
+}
 
-  if (!list_list_length)
-    return NULL;
-  auto list = array_remove_last_ptr(list_list);
-  return list;
+// The state after a complete value depends only on where it went.
+static inline uint8_t json_state_after_value(json_builder *builder) {
+  if (!builder->depth)
+    return DOC_END;
+  return builder->frames[builder->depth - 1].object ? OBJECT_NEXT
+                                                    : ARRAY_NEXT;
 }
 
-static void insert_json_value(json_token_t previous_token,
-                              hash_map *current_root, array_t *current_list,
-                              char **key_ptr, token_stream *tokens,
-                              void *dict_list, array_t *state_stack,
-                              map_value_type type, array_t *key_list) {
-  char *key = *key_ptr;
-  if (previous_token == COLON) {
-    union json_token_value popped_value =
-        tokens ? token_stream_pop_value(tokens)
-               : (union json_token_value){.null = NULL};
-    switch (type) {
-    case DICT:
-      hash_map_add_dict(current_root, key, dict_list);
-      break;
-    case LIST:
-      hash_map_add_list(current_root, key, dict_list);
-      break;
-    case TEXT:
-      hash_map_add_str(current_root, key, popped_value.string);
-      break;
-    case POINTER:
-    case NULLS:
-      hash_map_add_ptr(current_root, key, popped_value.ptr);
-      break;
-    case INTEGERS:
-      hash_map_add_int(current_root, key, popped_value.integer);
-      break;
-    case FLOATS:
-      hash_map_add_number(current_root, key, popped_value.number);
-      break;
-    case BOOLEANS:
-      hash_map_add_bool(current_root, key, popped_value.boolean);
-      break;
-    default:
-      // Optional: handle unexpected type
-      break;
-    }
-    *key_ptr = key_stack_pop(key_list);
-    state_stack_pop(state_stack);
+// A new container goes into its parent straight away and is filled in
+// place, so closing it only pops its frame. For events the handler hears of
+// it instead.
+static bool json_builder_open(json_builder *builder, bool object) {
+  void *container = NULL;
+  if (builder->handler) {
+    const json_handler *handler = builder->handler;
+    bool (*start)(void *) =
+        object ? handler->object_start : handler->array_start;
+    if (start && !start(builder->handler_ctx))
+      return false;
   } else {
-    union json_token_value popped_value =
-        tokens ? token_stream_pop_value(tokens)
-               : (union json_token_value){.null = NULL};
-    switch (type) {
-    case DICT:
-      array_append_dict(current_list, dict_list);
-      break;
-    case LIST:
-      array_append_list(current_list, dict_list);
-      break;
-    case TEXT:
-      array_append_str(current_list, popped_value.string);
-      break;
-    case POINTER:
-    case NULLS:
-      array_append_ptr(current_list, popped_value.ptr);
-      break;
-    case INTEGERS:
-      array_append_int(current_list, popped_value.integer);
-      break;
-    case FLOATS:
-      array_append_number(current_list, popped_value.number);
-      break;
-    case BOOLEANS:
-      array_append_bool(current_list, popped_value.boolean);
-      break;
-    default:
-      // Optional: handle unexpected type
-      break;
+    uint32_t size = json_builder_next_size(builder);
+    if (object) {
+      hash_map *map = create_hash_map_in(builder->arena);
+      if (!map || (size && !hash_map_reserve(map, size)))
+        return false;
+      container = map;
+    } else {
+      array_t *list = create_array_in(builder->arena);
+      if (!list || (size && !array_reserve(list, size)))
+        return false;
+      container = list;
     }
+    if (!insert_json_value(builder, object ? DICT : LIST,
+                           (json_token_value){.ptr = container}))
+      return false;
   }
 
-  state_stack_push(state_stack, VALUE);
-}
-
-bool parse_json_tokens(token_stream *tokens, json_value **root_node) {
-  json_token_t current_token;
-  array_t *state_stack = create_array();
-  array_t *node_stack = create_array();
-  array_t *root_list = create_array();
-  array_t *list_list = create_array();
-  array_t *key_list = create_array();
-  hash_map *current_root = NULL;
-  array_t *current_list = NULL;
-  char *key = NULL;
-  void *value;
-
-  json_value *current_value = *root_node = zcalloc(1, sizeof(*current_value));
-  json_value *parent_node = 0;
-  json_token_t previous_token = NO_TOKEN;
-
-  while ((current_token = token_stream_pop(tokens))) {
-    switch (current_token) {
-    case CURLY_OPEN: {
-      if (tokens->next_token_index > 1 && previous_token != COMMA &&
-          previous_token != CURLY_OPEN && previous_token != SQR_OPEN &&
-          previous_token != COLON) {
-        LOG_ERROR("Unexpected '{' at token position %" PRIu64 ".",
-                  tokens->next_token_index);
-        return false;
-      }
+  if (!json_builder_push(builder, container, object))
+    return false;
+  builder->state = object ? OBJECT_FIRST : ARRAY_FIRST;
+  return true;
+}
 
-      state_stack_push(state_stack, CURLY_OPEN);
+static bool json_builder_close(json_builder *builder) {
+  json_frame frame = builder->frames[--builder->depth];
+  if (builder->handler) {
+    const json_handler *handler = builder->handler;
+    bool (*end)(void *) = frame.object ? handler->object_end
+                                       : handler->array_end;
+    if (end && !end(builder->handler_ctx))
+      return false;
+  } else if (!frame.object && builder->arena) {
+    // Growth is geometric, so trim what is left over; in an arena this is
+    // free when the array was the last thing allocated.
+    array_shrink_to_fit(frame.container);
+  }
+  builder->state = json_state_after_value(builder);
+  return true;
+}
 
-      hash_map *new_root = create_hash_map();
-      if (current_value->type == UNKNOWN) {
-        current_value->value.ptr = new_root;
-        current_value->type = DICT;
-      }
+static void json_syntax_error(json_builder *builder, json_token_t token) {
+  if ((builder->state == OBJECT_KEY && token == CURLY_CLOSE) ||
+      (builder->state == ARRAY_VALUE && token == SQR_CLOSE))
+    LOG_ERROR("Trailing comma in %s at line %d column %d.",
+              token == CURLY_CLOSE ? "object" : "array", current_line,
+              current_column);
+  else
+    LOG_ERROR("Unexpected %s at line %d column %d.", json_token_names[token],
+              current_line, current_column);
+}
 
-      root_stack_push(root_list, current_root);
-      root_stack_push(root_list, key);
-      current_root = new_root;
+// Consumes a single token as soon as the tokenizer produces it, so the tree is
+// built while the input is scanned and no token stream is ever materialized.
+// The transition table picks the action for the current state and token;
+// everything it rejects is a syntax error.
+bool parse_json_token(json_builder *builder, json_token_t token,
+                      json_token_value value) {
+  uint8_t action = json_actions[builder->state][token];
+#ifdef JSON_COMPUTED_GOTO
+  static void *const dispatch[JSON_ACTION_COUNT] = {
+      [REJECT] = &&reject,
+      [OPEN_OBJECT] = &&open_object,
+      [OPEN_ARRAY] = &&open_array,
+      [CLOSE] = &&close,
+      [ACCEPT_KEY] = &&accept_key,
+      [ACCEPT_COLON] = &&accept_colon,
+      [MEMBER_COMMA] = &&member_comma,
+      [ELEMENT_COMMA] = &&element_comma,
+      [ACCEPT_VALUE] = &&accept_value,
+  };
+  goto *dispatch[action];
+#else
+  switch (action) {
+  case OPEN_OBJECT:
+    goto open_object;
+  case OPEN_ARRAY:
+    goto open_array;
+  case CLOSE:
+    goto close;
+  case ACCEPT_KEY:
+    goto accept_key;
+  case ACCEPT_COLON:
+    goto accept_colon;
+  case MEMBER_COMMA:
+    goto member_comma;
+  case ELEMENT_COMMA:
+    goto element_comma;
+  case ACCEPT_VALUE:
+    goto accept_value;
+  default:
+    goto reject;
+  }
+#endif
+
+open_object:
+  return json_builder_open(builder, true);
+open_array:
+  return json_builder_open(builder, false);
+close:
+  return json_builder_close(builder);
+accept_key:
+  if (builder->handler) {
+    if (!emit_json_key(builder, value))
+      return false;
+    value.string = NULL;
+  } else if (builder->keys) {
+    // The parsed copy is the newest arena allocation unless the key was
+    // new to the table, so a repeated key costs no memory.
+    json_key *key = key_table_intern(builder->keys, value.string, value.length);
+    arena_free(builder->arena, value.string);
+    if (!key)
+      return false;
+    value.string = key->str;
+  }
+  builder->key = value.string;
+  builder->key_length = value.length;
+  builder->state = OBJECT_COLON;
+  return true;
+accept_colon:
+  builder->state = OBJECT_VALUE;
+  return true;
+member_comma:
+  builder->state = OBJECT_KEY;
+  return true;
+element_comma:
+  builder->state = ARRAY_VALUE;
+  return true;
+accept_value:
+  if (!insert_json_value(builder, json_token_types[token], value))
+    return false;
+  builder->state = json_state_after_value(builder);
+  return true;
+reject:
+  json_syntax_error(builder, token);
+  if (token == STRING)
+    arena_free(builder->arena, value.string);
+  return false;
+}
 
-    } break;
-    case CURLY_CLOSE: {
-      previous_token = state_stack_peek(state_stack);
+// A document is complete once its root value is.
+static bool json_builder_finish(json_builder *builder) {
+  if (builder->state != DOC_END) {
+    LOG_ERROR("Unexpected end of input at line %d column %d.", current_line,
+              current_column);
+    return false;
+  }
+  return true;
+}
 
-      if (previous_token == VALUE) {
-        state_stack_pop(state_stack);
-        previous_token = state_stack_peek(state_stack);
+// Reads the file in large blocks and tokenizes every complete token of each
+// one. A token cut off by the end of a block moves to the front of the
+// buffer and is finished after the next read, so memory stays at one block
+// whatever the size of the file, unless a single token is larger.
+bool tokenize_json_file(FILE *f, json_builder *builder) {
+  current_line = 1;
+  current_column = 0;
+
+  size_t capacity = JSON_STREAM_BLOCK_SIZE;
+  char *buffer = zmalloc(capacity);
+  if (!buffer) {
+    LOG_ERROR("Failed to allocate read buffer");
+    return false;
+  }
+
+  size_t filled = 0;
+  bool eof = false;
+  bool tokenized = true;
+  while (tokenized && !eof) {
+    if (filled == capacity) {
+      char *tmp = zrealloc(buffer, capacity * 2);
+      if (!tmp) {
+        LOG_ERROR("Failed to grow read buffer to %zu bytes", capacity * 2);
+        tokenized = false;
+        break;
       }
-      if (previous_token == CURLY_OPEN) {
-        state_stack_pop(state_stack);
+      buffer = tmp;
+      capacity *= 2;
+    }
 
-        hash_map *value = current_root;
-        char *value_key = key;
-        key = root_stack_pop(root_list);
-        current_root = root_stack_pop(root_list);
+    size_t wanted = capacity - filled;
+    size_t got = fread(buffer + filled, 1, wanted, f);
+    filled += got;
+    if (got < wanted) {
+      if (ferror(f)) {
+        LOG_ERROR("Failed to read input file");
+        tokenized = false;
+        break;
+      }
+      eof = true;
+    }
 
-        previous_token = state_stack_peek(state_stack);
+    char *c = buffer;
+    tokenized = tokenize_json_chunk(&c, buffer + filled, builder, eof);
+    filled -= c - buffer;
+    memmove(buffer, c, filled);
+  }
 
-        if (previous_token == COLON || previous_token == SQR_OPEN) {
-          insert_json_value(
-              previous_token, previous_token == COLON ? current_root : NULL,
-              previous_token == SQR_OPEN ? current_list : NULL, &value_key,
-              NULL, value, state_stack, DICT, key_list);
+  zfree(buffer);
+  return tokenized && json_builder_finish(builder);
+}
 
-          key = value_key;
-        }
-      } else {
-        LOG_ERROR("Unexpected '}' without matching '{'");
-        return false;
-      }
-    } break;
-    case STRING: {
-      previous_token = state_stack_peek(state_stack);
-      if (previous_token == CURLY_OPEN) {
-        auto tmp = token_stream_pop_value(tokens);
-        key_stack_push(key_list, key);
-        key = tmp.string;
-      } else if (previous_token == COLON || previous_token == SQR_OPEN) {
-
-        insert_json_value(previous_token, current_root, current_list, &key,
-                          tokens, NULL, state_stack, TEXT, key_list);
-
-      } else {
-        LOG_ERROR("Unexpected string at position %" PRIu64 ".",
-                  tokens->next_token_index);
-        return false;
-      }
+// Records of a shared table live in its own arena; a document's own table
+// keeps them in the document arena and leaves arena unused.
+struct json_key_table {
+  hash_map *map;
+  json_arena arena;
+};
 
-    } break;
-    case COLON: {
-      previous_token = state_stack_peek(state_stack);
+// file is set for documents parsed from a path, whose strings may be views
+// into it.
+struct json_document {
+  json_arena arena;
+  json_key_table *keys;
+  json_value *root;
+  json_file_map file;
+};
 
-      if (previous_token != CURLY_OPEN) {
-        LOG_ERROR("Unexpected ':' outside object context");
-        return false;
-      }
-      previous_token = COLON;
-      state_stack_push(state_stack, previous_token);
+json_key_table *json_key_table_new() {
+  json_arena arena;
+  arena_init(&arena);
+  json_key_table *keys = arena_alloc(&arena, sizeof(*keys));
+  if (!keys)
+    return NULL;
+  keys->arena = arena;
+  if (!(keys->map = create_hash_map_in(&keys->arena))) {
+    json_key_table_free(keys);
+    return NULL;
+  }
+  return keys;
+}
 
-    } break;
-    case COMMA: {
-      previous_token = state_stack_peek(state_stack);
-
-      if (previous_token == VALUE) {
-        state_stack_pop(state_stack);
-
-        previous_token = state_stack_peek(state_stack);
-
-        switch (previous_token) {
-        case CURLY_OPEN: {
-          if (token_stream_peek(tokens) == CURLY_CLOSE) {
-            LOG_ERROR("Trailing comma in object at position %" PRIu64 ".",
-                      tokens->next_token_index);
-            return false;
-          }
-        } break;
-        case SQR_OPEN: {
-          if (token_stream_peek(tokens) == SQR_CLOSE) {
-            LOG_ERROR("Trailing comma in array at position %" PRIu64 ".",
-                      tokens->next_token_index);
-            return false;
-          }
-
-        } break;
-        default: {
-          fprintf(stderr, "Weird stuff.\n");
-
-          return false;
-        }
-        }
-      } else {
-        LOG_ERROR("Unexpected comma at position %" PRIu64 ".",
-                  tokens->next_token_index);
+void json_key_table_free(json_key_table *keys) {
+  if (!keys)
+    return;
+  json_arena arena = keys->arena;
+  arena_release(&arena);
+}
 
-        return false;
-      }
-    } break;
-    case SQR_OPEN: {
-      if (tokens->next_token_index == 1 || !parent_node) {
-      }
-      previous_token = state_stack_peek(state_stack);
+// The document header lives in its own arena, so releasing the arena is all
+// it takes to free the document. Without a shared key table the document
+// interns its keys in a table of its own.
+static json_document *json_document_new(json_key_table *keys) {
+  json_arena arena;
+  arena_init(&arena);
+  json_document *doc = arena_alloc(&arena, sizeof(*doc));
+  if (!doc)
+    return NULL;
+  doc->arena = arena;
+  doc->root = NULL;
+  doc->keys = keys;
+  memset(&doc->file, 0, sizeof(doc->file));
+  if (!keys) {
+    doc->keys = arena_calloc(&doc->arena, 1, sizeof(*doc->keys));
+    if (!doc->keys || !(doc->keys->map = create_hash_map_in(&doc->arena))) {
+      json_document_free(doc);
+      return NULL;
+    }
+  }
+  return doc;
+}
 
-      if (!(!parent_node && tokens->next_token_index == 1) &&
-          previous_token != COLON && previous_token != SQR_OPEN) {
-        LOG_ERROR("Unexpected '[' at token position %" PRIu64 ".",
-                  tokens->next_token_index);
-        return false;
-      }
+void json_document_free(json_document *doc) {
+  if (!doc)
+    return;
+  json_file_map_close(&doc->file);
+  json_arena arena = doc->arena;
+  arena_release(&arena);
+}
 
-      previous_token = SQR_OPEN;
-      state_stack_push(state_stack, previous_token);
+json_value *json_document_root(json_document *doc) {
+  return doc ? doc->root : NULL;
+}
 
-      array_t *new_list = create_array();
-      if (current_value->type == UNKNOWN) {
-        current_value->value.ptr = new_list;
-        current_value->type = LIST;
-      }
+json_key_table *json_document_keys(json_document *doc) {
+  return doc ? doc->keys : NULL;
+}
 
-      list_stack_push(list_list, current_list);
-      current_list = new_list;
+// Resolves a key once so that json_query_key can look it up in every object
+// of a document without hashing or comparing bytes. Returns NULL if no object
+// parsed with the table has the key.
+const json_key *json_key_find(json_key_table *keys, const char *key,
+                              size_t key_len) {
+  if (!keys || key_len > UINT32_MAX)
+    return NULL;
+  return key_table_find(keys->map, key, key_len);
+}
 
-    } break;
-    case SQR_CLOSE:
+static json_value *parse_json_file_in(FILE *f, json_arena *arena,
+                                      hash_map *keys) {
+  json_builder builder;
+  if (!json_builder_init(&builder, arena))
+    return NULL;
+  builder.keys = keys;
 
-    {
-      previous_token = state_stack_peek(state_stack);
+  bool parsed = tokenize_json_file(f, &builder);
+  json_builder_release(&builder);
 
-      if (previous_token == VALUE) {
-        state_stack_pop(state_stack);
-        previous_token = state_stack_peek(state_stack);
-      }
+  if (!parsed) {
+    arena_free(arena, builder.root);
+    return NULL;
+  }
+
+  return builder.root;
+}
+
+// Parses str with a builder that is already initialized for the document.
+static json_value *parse_json_buffer_with(json_builder *builder, char *str,
+                                          size_t length,
+                                          json_parse_flags flags) {
+  current_line = 1;
+  current_column = 0;
+
+  builder->lazy_numbers = flags & JSON_PARSE_LAZY_NUMBERS;
+  if (!tokenize_json_buffer(str, length, builder,
+                            flags & JSON_PARSE_PRESIZE) ||
+      !json_builder_finish(builder)) {
+    arena_free(builder->arena, builder->root);
+    return NULL;
+  }
+  return builder->root;
+}
+
+static json_value *parse_json_string_in(char *str, size_t length,
+                                        json_arena *arena, hash_map *keys,
+                                        bool insitu, bool views,
+                                        json_parse_flags flags) {
+  json_builder builder;
+  if (!json_builder_init(&builder, arena))
+    return NULL;
+  builder.keys = keys;
+  builder.insitu = insitu;
+  builder.views = views;
+
+  json_value *root = parse_json_buffer_with(&builder, str, length, flags);
+  json_builder_release(&builder);
+  return root;
+}
+
+// Builds the one value spanning [start, end) of an indexed buffer into
+// arena, given the count index positions from the value's first one on.
+// Strings without escapes stay views into the buffer, which is only read.
+// Object keys are interned in keys if it is set and borrowed from the buffer
+// otherwise. Error positions count from start.
+json_value *json_parse_indexed_value(char *string, char *start, char *end,
+                                     const uint32_t *positions, uint64_t count,
+                                     json_arena *arena, hash_map *keys) {
+  json_builder builder;
+  if (!json_builder_init(&builder, arena))
+    return NULL;
+  builder.views = true;
+  builder.keys = keys;
+  current_line = 1;
+  current_column = 0;
+
+  bool parsed =
+      tokenize_json_range(string, start, end, positions, count, &builder) &&
+      json_builder_finish(&builder);
+  json_builder_release(&builder);
+  if (!parsed) {
+    arena_free(arena, builder.root);
+    return NULL;
+  }
+  return builder.root;
+}
+
+json_value *json_parse_file(FILE *f) {
+  if (!f) {
+    LOG_ERROR("Received NULL file pointer");
+    return NULL;
+  }
+
+  return parse_json_file_in(f, NULL, NULL);
+}
+
+json_value *json_parse_string(char *str) {
+  if (!str) {
+    LOG_ERROR("Received NULL input string");
+    return NULL;
+  }
+
+  return parse_json_string_in(str, strlen(str), NULL, NULL, false, false,
+                              JSON_PARSE_DEFAULT);
+}
+
+json_document *json_parse_document(char *str) {
+  return json_parse_document_flags(str, NULL, JSON_PARSE_DEFAULT);
+}
+
+// Keys already in the shared table are reused; new ones are added to it.
+json_document *json_parse_document_shared(char *str, json_key_table *keys) {
+  return json_parse_document_flags(str, keys, JSON_PARSE_DEFAULT);
+}
+
+static json_document *parse_json_document_in(char *str, size_t length,
+                                             json_key_table *keys,
+                                             json_parse_flags flags) {
+  json_document *doc = json_document_new(keys);
+  if (!doc)
+    return NULL;
+  if (!(doc->root = parse_json_string_in(str, length, &doc->arena,
+                                         doc->keys->map, false, false,
+                                         flags))) {
+    json_document_free(doc);
+    return NULL;
+  }
+  return doc;
+}
+
+json_document *json_parse_document_flags(char *str, json_key_table *keys,
+                                         json_parse_flags flags) {
+  if (!str) {
+    LOG_ERROR("Received NULL input string");
+    return NULL;
+  }
+
+  return parse_json_document_in(str, strlen(str), keys, flags);
+}
+
+// Strings are unescaped inside buf and TEXT values point into it, so buf
+// must stay alive and untouched for as long as the document is used. Keys
+// are interned, so they are copied into the document's key table.
+json_document *json_parse_string_insitu(char *buf, size_t len) {
+  if (!buf) {
+    LOG_ERROR("Received NULL input buffer");
+    return NULL;
+  }
+
+  json_document *doc = json_document_new(NULL);
+  if (!doc)
+    return NULL;
+  if (!(doc->root = parse_json_string_in(buf, len, &doc->arena,
+                                         doc->keys->map, true, false,
+                                         JSON_PARSE_DEFAULT))) {
+    json_document_free(doc);
+    return NULL;
+  }
+  return doc;
+}
+
+// The file is mapped and parsed where it lies: TEXT values without escapes
+// are views into the mapping, which the document keeps until it is freed.
+// Such views are not NUL-terminated; read them with json_value_text.
+json_document *json_parse_path(const char *path) {
+  if (!path) {
+    LOG_ERROR("Received NULL path");
+    return NULL;
+  }
+
+  json_document *doc = json_document_new(NULL);
+  if (!doc)
+    return NULL;
+  if (!json_file_map_open(path, &doc->file) ||
+      !(doc->root = parse_json_string_in(doc->file.data, doc->file.size,
+                                         &doc->arena, doc->keys->map, false,
+                                         true, JSON_PARSE_DEFAULT))) {
+    json_document_free(doc);
+    return NULL;
+  }
+  return doc;
+}
+
+// Compiles the paths, indexes buf and builds only what they select; every
+// other subtree is skipped over the index, so none of its keys, strings or
+// containers are allocated or checked. Strings without escapes are views
+// into buf, which is only read and must outlive the document.
+json_document *json_parse_projected(const char *buf, size_t len,
+                                    const char *const *paths, size_t count) {
+  if (!buf || (count && !paths)) {
+    LOG_ERROR("Received NULL input buffer or paths");
+    return NULL;
+  }
+
+  json_path **compiled = zcalloc(count ? count : 1, sizeof(*compiled));
+  if (!compiled) {
+    LOG_ERROR("Failed to allocate projected paths");
+    return NULL;
+  }
+  json_document *doc = NULL;
+  json_ondemand *ondemand = NULL;
+  for (size_t k = 0; k < count; k++)
+    if (!(compiled[k] = json_path_compile(paths[k])))
+      goto done;
+
+  if (!(ondemand = json_parse_ondemand(buf, len)) ||
+      !(doc = json_document_new(NULL)))
+    goto done;
+  if (!(doc->root = json_ondemand_project(ondemand, compiled, count,
+                                          &doc->arena, doc->keys->map))) {
+    json_document_free(doc);
+    doc = NULL;
+  }
+
+done:
+  json_ondemand_free(ondemand);
+  for (size_t k = 0; k < count; k++)
+    json_path_free(compiled[k]);
+  zfree(compiled);
+  return doc;
+}
+
+json_document *json_parse_document_file(FILE *f) {
+  if (!f) {
+    LOG_ERROR("Received NULL file pointer");
+    return NULL;
+  }
+
+  json_document *doc = json_document_new(NULL);
+  if (!doc)
+    return NULL;
+  if (!(doc->root = parse_json_file_in(f, &doc->arena, doc->keys->map))) {
+    json_document_free(doc);
+    return NULL;
+  }
+  return doc;
+}
 
-      if (previous_token == SQR_OPEN) {
-        state_stack_pop(state_stack);
+// One share of the elements of the root container: the index entries after
+// begin and before end, parsed by one thread into a container of its own.
+typedef struct json_share {
+  char *string;
+  const uint32_t *positions;
+  uint64_t begin;
+  uint64_t end;
+  json_token_t open;
+  json_token_t close;
+  json_parse_flags flags;
+  json_arena arena;
+  hash_map *keys;
+  json_value *root;
+  // The document's intern table once the shares' keys are merged into it.
+  hash_map *document_keys;
+  bool rekeyed;
+} json_share;
+
+// The share is framed by the root's own brackets, so the builder checks it
+// exactly as it would check the whole container. Error positions count from
+// the start of the share.
+static int parse_json_share(void *arg) {
+  json_share *share = arg;
+  current_line = 1;
+  current_column = 0;
 
-        array_t *value = current_list;
-        current_list = list_stack_pop(list_list);
+  json_builder builder;
+  if (!json_builder_init(&builder, &share->arena))
+    return 0;
+  builder.keys = share->keys = create_hash_map_in(&share->arena);
+  builder.lazy_numbers = share->flags & JSON_PARSE_LAZY_NUMBERS;
+
+  char *string = share->string;
+  const uint32_t *positions = share->positions;
+  if (share->flags & JSON_PARSE_PRESIZE)
+    json_count_elements(string, positions + share->begin,
+                        share->end - share->begin + 1, true, &builder);
+  if (builder.keys &&
+      parse_json_token(&builder, share->open, (json_token_value){}) &&
+      tokenize_json_range(string, string + positions[share->begin] + 1,
+                          string + positions[share->end],
+                          positions + share->begin + 1,
+                          share->end - share->begin - 1, &builder) &&
+      parse_json_token(&builder, share->close, (json_token_value){}) &&
+      json_builder_finish(&builder))
+    share->root = builder.root;
+  json_builder_release(&builder);
+  return 0;
+}
 
-        previous_token = state_stack_peek(state_stack);
+// Moves the keys of every object of the share from its own intern table to
+// the document's. Nesting is not limited, so the walk keeps its containers
+// on a stack of its own rather than recursing.
+static int rekey_json_share(void *arg) {
+  json_share *share = arg;
+  uint64_t capacity = JSON_FRAMES_INITIAL;
+  uint64_t depth = 0;
+  json_value **stack = zmalloc(capacity * sizeof(*stack));
+  if (!stack) {
+    LOG_ERROR("Failed to allocate key walk stack");
+    return 0;
+  }
 
-        if (previous_token == COLON || previous_token == SQR_OPEN) {
+  stack[depth++] = share->root;
+  while (depth) {
+    json_value *value = stack[--depth];
+    hash_map *map = NULL;
+    array_t *list = NULL;
+    uint64_t length;
+    if (map_value_get_type(value) == DICT) {
+      map = map_value_get_data(value).ptr;
+      if (!hash_map_rekey(map, share->document_keys))
+        goto done;
+      length = hash_map_length(map);
+    } else {
+      list = map_value_get_data(value).ptr;
+      length = array_length(list);
+    }
 
-          insert_json_value(previous_token,
-                            previous_token == COLON ? current_root : NULL,
-                            previous_token == SQR_OPEN ? current_list : NULL,
-                            &key, NULL, value, state_stack, LIST, key_list);
+    uint64_t cursor = 0;
+    for (uint64_t i = 0; i < length && i <= INT32_MAX; i++) {
+      json_value *child =
+          map ? hash_map_next_value(map, &cursor) : array_get(list, i);
+      map_value_type type = map_value_get_type(child);
+      if (type != DICT && type != LIST)
+        continue;
+      if (depth == capacity) {
+        json_value **tmp = zrealloc(stack, 2 * capacity * sizeof(*stack));
+        if (!tmp) {
+          LOG_ERROR("Failed to grow key walk stack to %" PRIu64 " entries",
+                    2 * capacity);
+          goto done;
         }
-      } else {
-        LOG_ERROR("Unexpected ']' without matching '['");
-        return false;
-      }
-    } break;
-    case BOOLEAN: {
-      previous_token = state_stack_peek(state_stack);
-      if (previous_token != COLON && previous_token != SQR_OPEN) {
-        LOG_ERROR("Unexpected boolean");
-        return false;
+        stack = tmp;
+        capacity *= 2;
       }
+      stack[depth++] = child;
+    }
+  }
+  share->rekeyed = true;
 
-      insert_json_value(previous_token, current_root, current_list, &key,
-                        tokens, NULL, state_stack, BOOLEANS, key_list);
+done:
+  zfree(stack);
+  return 0;
+}
 
-    } break;
-    case NUMBER: {
-      previous_token = state_stack_peek(state_stack);
-      if (previous_token != COLON && previous_token != SQR_OPEN) {
-        LOG_ERROR("Unexpected number");
-        return false;
-      }
+// Runs fn on every share, on threads of their own where they can be started
+// and on the calling thread otherwise.
+static void json_run_shares(json_share *shares, uint64_t count,
+                            thrd_t *threads, bool *running, thrd_start_t fn) {
+  for (uint64_t i = 1; i < count; i++)
+    running[i] = thrd_create(&threads[i], fn, &shares[i]) == thrd_success;
+  fn(&shares[0]);
+  for (uint64_t i = 1; i < count; i++) {
+    if (running[i])
+      thrd_join(threads[i], NULL);
+    else
+      fn(&shares[i]);
+  }
+}
 
-      insert_json_value(previous_token, current_root, current_list, &key,
-                        tokens, NULL, state_stack, FLOATS, key_list);
+// Fills cuts with the index entries that delimit shares of the root
+// container: its opening bracket, up to shares - 1 top-level commas placed
+// at even byte intervals, and its closing bracket. Returns the number of
+// shares, or 0 when the input is not a single container with a non-empty
+// element between every two cuts; it is then left to the serial parser,
+// which also reports any error in it.
+static uint64_t json_split_root(const char *string, size_t length,
+                                json_structural_index *index, uint64_t *cuts,
+                                uint64_t shares) {
+  if (!index->count || index->has_comments)
+    return 0;
+  char open = string[index->positions[0]];
+  if (open != '[' && open != '{')
+    return 0;
 
-    } break;
-    case NIL: {
-      previous_token = state_stack_peek(state_stack);
-      if (previous_token != COLON && previous_token != SQR_OPEN) {
-        LOG_ERROR("Unexpected null");
-        return false;
+  uint64_t count = 0;
+  cuts[count++] = 0;
+  uint64_t depth = 0;
+  bool closed = false;
+  for (uint64_t i = 1; i < index->count && !closed; i++) {
+    char c = string[index->positions[i]];
+    if (c == '[' || c == '{') {
+      depth++;
+    } else if (c == ']' || c == '}') {
+      if (depth) {
+        depth--;
+        continue;
       }
+      if (c != (open == '[' ? ']' : '}') || i + 1 != index->count)
+        return 0;
+      cuts[count++] = i;
+      closed = true;
+    } else if (c == ',' && !depth && count < shares &&
+               index->positions[i] >= count * length / shares) {
+      cuts[count++] = i;
+    }
+  }
+  if (!closed)
+    return 0;
 
-      insert_json_value(previous_token, current_root, current_list, &key, NULL,
-                        NULL, state_stack, NULLS, key_list);
+  for (const char *c = string + index->positions[cuts[count - 1]] + 1;
+       c < string + length; c++)
+    if (*c != ' ' && *c != '\t' && *c != '\r' && *c != '\n')
+      return 0;
+  for (uint64_t i = 0; i + 1 < count; i++)
+    if (cuts[i + 1] - cuts[i] < 2)
+      return 0;
+  return count - 1;
+}
 
-    } break;
-    default:
+// Joins the containers of all shares into one root. The shares' keys are
+// interned in the document's table first and every object is pointed at it
+// on the shares' threads, so keys compare by pointer across the whole
+// document. Every share's arena is handed to the document, so their nodes,
+// strings and key records stay where they are; only the root's element
+// array or table is new.
+static bool json_join_shares(json_document *doc, json_share *shares,
+                             uint64_t count, thrd_t *threads, bool *running) {
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    if (!shares[i].root)
       return false;
-    }
+    json_value *root = shares[i].root;
+    total += map_value_get_type(root) == LIST
+                 ? array_length(map_value_get_data(root).ptr)
+                 : hash_map_length(map_value_get_data(root).ptr);
   }
 
-  return true;
-}
+  for (uint64_t i = 0; i < count; i++) {
+    if (!key_table_merge(doc->keys->map, shares[i].keys))
+      return false;
+    shares[i].document_keys = doc->keys->map;
+  }
+  json_run_shares(shares, count, threads, running, rekey_json_share);
+  for (uint64_t i = 0; i < count; i++)
+    if (!shares[i].rekeyed)
+      return false;
 
-bool tokenize_json_file(FILE *f, token_stream *tokens) {
-  current_line = 0;
-  current_column = 0;
-  char buffer[4096];
-  while (fgets(buffer, sizeof(buffer), f)) {
-    if (!tokenize_json_string(buffer, tokens))
+  json_value *root = arena_calloc(&doc->arena, 1, sizeof(*root));
+  if (!root)
+    return false;
+  map_value_type type = map_value_get_type(shares[0].root);
+  void *container;
+  if (type == LIST) {
+    array_t *list = create_array_in(&doc->arena);
+    if (!list || !array_reserve(list, total))
+      return false;
+    for (uint64_t i = 0; i < count; i++)
+      array_append_all(list, map_value_get_data(shares[i].root).ptr);
+    container = list;
+  } else {
+    hash_map *map = create_hash_map_in(&doc->arena);
+    if (!map || !hash_map_reserve(map, total))
       return false;
+    for (uint64_t i = 0; i < count; i++)
+      if (!hash_map_merge(map, map_value_get_data(shares[i].root).ptr))
+        return false;
+    container = map;
   }
-  token_stream_append_token(tokens, NO_TOKEN);
+  map_value_make(&doc->arena, type, (json_data){.ptr = container}, 0, root);
+
+  for (uint64_t i = 0; i < count; i++)
+    arena_adopt(&doc->arena, &shares[i].arena);
+  doc->root = root;
   return true;
 }
 
-json_value *json_parse_file(FILE *f) {
-  if (!f) {
-    LOG_ERROR("Received NULL file pointer");
+// Splits the root container at top-level commas found from the structural
+// index and parses the shares on nthreads threads, the calling thread
+// included, each into its own arena. The shares' containers are then joined
+// into one root. Inputs that are small, not a single array or object, or
+// have comments are parsed on one thread.
+json_document *json_parse_parallel(char *buf, size_t len, int nthreads,
+                                   json_parse_flags flags) {
+  if (!buf) {
+    LOG_ERROR("Received NULL input buffer");
     return NULL;
   }
+  if (nthreads < 2 || len < JSON_PARALLEL_MIN_LENGTH || len > UINT32_MAX)
+    return parse_json_document_in(buf, len, NULL, flags);
+
+  json_structural_index index = {0};
+  uint64_t *cuts = zmalloc((nthreads + 1) * sizeof(*cuts));
+  json_share *shares = zcalloc(nthreads, sizeof(*shares));
+  thrd_t *threads = zcalloc(nthreads, sizeof(*threads));
+  bool *running = zcalloc(nthreads, sizeof(*running));
+  uint64_t count = 0;
+  if (cuts && shares && threads && running &&
+      json_structural_index_build(buf, len, &index))
+    count = json_split_root(buf, len, &index, cuts, nthreads);
+
+  json_document *doc = NULL;
+  if (count < 2) {
+    doc = parse_json_document_in(buf, len, NULL, flags);
+  } else {
+    for (uint64_t i = 0; i < count; i++) {
+      shares[i] = (json_share){
+          .string = buf,
+          .positions = index.positions,
+          .begin = cuts[i],
+          .end = cuts[i + 1],
+          .open = buf[index.positions[0]] == '[' ? SQR_OPEN : CURLY_OPEN,
+          .close = buf[index.positions[0]] == '[' ? SQR_CLOSE : CURLY_CLOSE,
+          .flags = flags,
+      };
+      arena_init(&shares[i].arena);
+    }
+    json_run_shares(shares, count, threads, running, parse_json_share);
 
-  token_stream tokens;
-  memset(&tokens, 0, sizeof(tokens));
+    doc = json_document_new(NULL);
+    if (doc && !json_join_shares(doc, shares, count, threads, running)) {
+      json_document_free(doc);
+      doc = NULL;
+    }
+    for (uint64_t i = 0; i < count; i++)
+      arena_release(&shares[i].arena);
+  }
 
-  if (!tokenize_json_file(f, &tokens)) {
+  json_structural_index_release(&index);
+  zfree(running);
+  zfree(threads);
+  zfree(shares);
+  zfree(cuts);
+  return doc;
+}
+
+// A builder and structural index kept across documents, so parsing many
+// small ones does not allocate them afresh each time. line and column are
+// where the last parse stopped.
+struct json_context {
+  json_builder builder;
+  json_structural_index index;
+  int line;
+  int column;
+};
+
+json_context *json_context_new() {
+  json_context *ctx = zcalloc(1, sizeof(*ctx));
+  if (!ctx) {
+    LOG_ERROR("Failed to allocate parser context");
     return NULL;
   }
+  return ctx;
+}
 
-  if (!tokens.tokens_array) {
+void json_context_free(json_context *ctx) {
+  if (!ctx)
+    return;
+  json_builder_release(&ctx->builder);
+  json_structural_index_release(&ctx->index);
+  zfree(ctx);
+}
+
+json_document *json_context_parse(json_context *ctx, char *str, size_t length,
+                                  json_parse_flags flags) {
+  if (!ctx || !str) {
+    LOG_ERROR("Received NULL context or input string");
     return NULL;
   }
 
-  json_value *value = NULL; // zcalloc(1, sizeof(*value));
-  if (!parse_json_tokens(&tokens, &value)) {
-    zfree(value);
+  json_document *doc = json_document_new(NULL);
+  if (!doc)
+    return NULL;
+  json_builder *builder = &ctx->builder;
+  if (!json_builder_reuse(builder, &doc->arena)) {
+    json_document_free(doc);
+    return NULL;
+  }
+  builder->keys = doc->keys->map;
+  builder->index = &ctx->index;
+  doc->root = parse_json_buffer_with(builder, str, length, flags);
+  ctx->line = current_line;
+  ctx->column = current_column;
+  if (!doc->root) {
+    json_document_free(doc);
     return NULL;
   }
+  return doc;
+}
 
-  return value;
+void json_context_position(json_context *ctx, int *line, int *column) {
+  *line = ctx->line;
+  *column = ctx->column;
 }
 
-json_value *json_parse_string(char *str) {
-  if (!str) {
-    LOG_ERROR("Received NULL input string");
-    return NULL;
+// Event parsing runs the tokenizer and the grammar checks of the tree builder
+// with a handler in place of the tree. Strings without escapes are passed as
+// views into the input; escaped ones are decoded into a scratch arena that is
+// emptied after every callback. Only the state stack grows, with nesting
+// depth, and the structural index is skipped since it grows with the input.
+static bool json_events_init(json_builder *builder, json_arena *scratch,
+                             const json_handler *handler, void *ctx) {
+  arena_init(scratch);
+  if (!json_builder_init(builder, scratch))
+    return false;
+  builder->views = true;
+  builder->handler = handler;
+  builder->handler_ctx = ctx;
+  return true;
+}
+
+// The input is only read; the tokenizer takes it as char * because in situ
+// parsing writes to it.
+bool json_parse_events(const char *str, size_t len, const json_handler *handler,
+                       void *ctx) {
+  if (!str || !handler) {
+    LOG_ERROR("Received NULL input string or handler");
+    return false;
   }
 
-  current_line = 0;
+  current_line = 1;
   current_column = 0;
-  token_stream tokens;
-  memset(&tokens, 0, sizeof(tokens));
 
-  if (!tokenize_json_string(str, &tokens)) {
+  json_arena scratch;
+  json_builder builder;
+  if (!json_events_init(&builder, &scratch, handler, ctx)) {
+    arena_release(&scratch);
+    return false;
+  }
+  bool parsed = tokenize_json_string((char *)str, len, &builder) &&
+                json_builder_finish(&builder);
+  json_builder_release(&builder);
+  arena_release(&scratch);
+  return parsed;
+}
+
+// Reads the file in blocks like json_parse_file, so memory stays at one block
+// whatever the size of the file.
+bool json_parse_events_file(FILE *f, const json_handler *handler, void *ctx) {
+  if (!f || !handler) {
+    LOG_ERROR("Received NULL file pointer or handler");
+    return false;
+  }
+
+  json_arena scratch;
+  json_builder builder;
+  if (!json_events_init(&builder, &scratch, handler, ctx)) {
+    arena_release(&scratch);
+    return false;
+  }
+  bool parsed = tokenize_json_file(f, &builder);
+  json_builder_release(&builder);
+  arena_release(&scratch);
+  return parsed;
+}
+
+// Incremental parser fed with arbitrary pieces of one document. Complete
+// tokens are consumed straight from each piece; only a token cut off at the
+// end of a piece is kept in pending until the next one completes it. The
+// parse position lives here between calls, since the tokenizer reports
+// errors against current_line and current_column.
+struct json_parser {
+  json_document *doc;
+  json_builder builder;
+  char *pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  int line;
+  int column;
+  bool failed;
+};
+
+json_parser *json_parser_new() {
+  json_parser *parser = zcalloc(1, sizeof(*parser));
+  if (!parser) {
+    LOG_ERROR("Failed to allocate parser");
     return NULL;
   }
-  if (!tokens.tokens_array) {
+  parser->doc = json_document_new(NULL);
+  if (!parser->doc ||
+      !json_builder_init(&parser->builder, &parser->doc->arena)) {
+    json_document_free(parser->doc);
+    zfree(parser);
     return NULL;
   }
+  parser->builder.keys = parser->doc->keys->map;
+  parser->line = 1;
+  return parser;
+}
+
+void json_parser_free(json_parser *parser) {
+  if (!parser)
+    return;
+  json_builder_release(&parser->builder);
+  json_document_free(parser->doc);
+  zfree(parser->pending);
+  zfree(parser);
+}
+
+static bool json_parser_keep(json_parser *parser, const char *bytes,
+                             size_t length) {
+  if (!length)
+    return true;
+  size_t needed = parser->pending_length + length;
+  if (needed > parser->pending_capacity) {
+    size_t capacity = parser->pending_capacity ? parser->pending_capacity
+                                               : JSON_STRING_INITIAL_SIZE;
+    while (capacity < needed)
+      capacity *= 2;
+    char *tmp = zrealloc(parser->pending, capacity);
+    if (!tmp) {
+      LOG_ERROR("Failed to grow parser buffer to %zu bytes", capacity);
+      return false;
+    }
+    parser->pending = tmp;
+    parser->pending_capacity = capacity;
+  }
+  memcpy(parser->pending + parser->pending_length, bytes, length);
+  parser->pending_length += length;
+  return true;
+}
+
+// Completes the pending token with as little of chunk as it needs, in
+// doubling steps, and tokenizes it. Returns how many bytes of chunk were
+// used, which is all of them while the token is still incomplete.
+static bool json_parser_complete(json_parser *parser, const char *chunk,
+                                 size_t length, size_t *used) {
+  size_t appended = 0;
+  size_t step = JSON_STRING_INITIAL_SIZE;
+  do {
+    size_t take = length - appended < step ? length - appended : step;
+    if (!json_parser_keep(parser, chunk + appended, take))
+      return false;
+    appended += take;
+    step *= 2;
+  } while (appended < length &&
+           !json_token_complete(parser->pending,
+                                parser->pending + parser->pending_length));
+
+  if (!json_token_complete(parser->pending,
+                           parser->pending + parser->pending_length)) {
+    *used = length;
+    return true;
+  }
+
+  // Whatever the tokenizer leaves over started inside chunk, so it is
+  // picked up from there again rather than kept.
+  char *c = parser->pending;
+  char *end = parser->pending + parser->pending_length;
+  if (!tokenize_json_chunk(&c, end, &parser->builder, false))
+    return false;
+  *used = appended - (end - c);
+  parser->pending_length = 0;
+  return true;
+}
+
+bool json_parser_feed(json_parser *parser, const char *chunk, size_t length) {
+  if (!parser) {
+    LOG_ERROR("Received NULL parser");
+    return false;
+  }
+  if (!chunk && length) {
+    LOG_ERROR("Received NULL chunk of %zu bytes", length);
+    return false;
+  }
+  if (parser->failed)
+    return false;
+
+  current_line = parser->line;
+  current_column = parser->column;
+
+  size_t used = 0;
+  bool fed = true;
+  if (parser->pending_length)
+    fed = json_parser_complete(parser, chunk, length, &used);
+  if (fed && !parser->pending_length) {
+    char *c = (char *)chunk + used;
+    char *end = (char *)chunk + length;
+    fed = tokenize_json_chunk(&c, end, &parser->builder, false) &&
+          json_parser_keep(parser, c, end - c);
+  }
 
-  json_value *value = NULL; // zcalloc(1, sizeof(*value));
-  if (!parse_json_tokens(&tokens, &value)) {
-    zfree(value);
+  parser->line = current_line;
+  parser->column = current_column;
+  parser->failed = !fed;
+  return fed;
+}
+
+// Tokenizes whatever is pending as the end of the input and hands over the
+// document. The parser is freed either way.
+json_document *json_parser_finish(json_parser *parser) {
+  if (!parser)
     return NULL;
+
+  current_line = parser->line;
+  current_column = parser->column;
+
+  json_document *doc = NULL;
+  char *c = parser->pending;
+  if (!parser->failed &&
+      tokenize_json_chunk(&c, parser->pending + parser->pending_length,
+                          &parser->builder, true) &&
+      json_builder_finish(&parser->builder)) {
+    doc = parser->doc;
+    doc->root = parser->builder.root;
+    parser->doc = NULL;
   }
 
-  return value;
+  json_parser_free(parser);
+  return doc;
 }
 
 json_value *json_query(json_value *node, char *key) {
-  if (node->type == DICT) {
-    return hash_map_get(node->value.ptr, key);
+  return json_query_n(node, key, strlen(key));
+}
+
+json_value *json_query_n(json_value *node, const char *key, size_t key_len) {
+  if (map_value_get_type(node) == DICT && key_len <= UINT32_MAX) {
+    return hash_map_get(map_value_get_data(node).ptr, key, key_len);
   }
   return NULL;
 }
 
-map_value_type json_value_type(json_value *node) { return node->type; }
+json_value *json_query_key(json_value *node, const json_key *key) {
+  if (map_value_get_type(node) == DICT && key)
+    return hash_map_get_key(map_value_get_data(node).ptr, key);
+  return NULL;
+}
+
+map_value_type json_value_type(json_value *node) {
+  return map_value_get_type(node);
+}
 
-json_data json_value_data(json_value *node) { return node->value; }
+static inline bool json_is_lazy_number(json_value *node) {
+  map_value_type type = map_value_get_type(node);
+  return (type == INTEGERS || type == FLOATS) && map_value_get_length(node);
+}
+
+// Converts a lazy number on first use and caches the result in its record.
+// Readers racing on the first use each convert the literal themselves and
+// only one of them stores the result, so reading a document from several
+// threads stays safe. Out-of-range literals are reported and read as the
+// overflowed or underflowed double.
+static json_data json_lazy_number_value(json_value *node) {
+  json_lazy_number *lazy = map_value_get_data(node).ptr;
+  if (atomic_load_explicit(&lazy->state, memory_order_acquire) ==
+      LAZY_CONVERTED)
+    return lazy->value;
+
+  json_data value;
+  map_value_type type;
+  bool in_range =
+      json_scan_number(lazy->text, lazy->text + lazy->length, &value, &type);
+  unsigned char expected = LAZY_PENDING;
+  if (atomic_compare_exchange_strong_explicit(
+          &lazy->state, &expected, LAZY_CONVERTING, memory_order_relaxed,
+          memory_order_relaxed)) {
+    if (!in_range)
+      LOG_ERROR("Number %.*s is out of range.", (int)lazy->length, lazy->text);
+    lazy->value = value;
+    atomic_store_explicit(&lazy->state, LAZY_CONVERTED, memory_order_release);
+  }
+  return value;
+}
+
+json_data json_value_data(json_value *node) {
+  if (json_is_lazy_number(node))
+    return json_lazy_number_value(node);
+  return map_value_get_data(node);
+}
+
+bool json_value_int64(json_value *node, int64_t *integer) {
+  if (map_value_get_type(node) != INTEGERS)
+    return false;
+  *integer = json_value_data(node).integer;
+  return true;
+}
+
+// Integers are converted, so any number can be read as a double.
+bool json_value_double(json_value *node, double *number) {
+  map_value_type type = map_value_get_type(node);
+  if (type == INTEGERS)
+    *number = (double)json_value_data(node).integer;
+  else if (type == FLOATS)
+    *number = json_value_data(node).number;
+  else
+    return false;
+  return true;
+}
+
+// The literal exactly as written, for numbers parsed lazily; big integers
+// and long decimals can be read from it without rounding.
+json_text json_value_number_text(json_value *node) {
+  if (!json_is_lazy_number(node))
+    return (json_text){0};
+  json_lazy_number *lazy = map_value_get_data(node).ptr;
+  return (json_text){.data = lazy->text, .length = lazy->length};
+}
+
+json_text json_value_text(json_value *node) {
+  if (map_value_get_type(node) != TEXT)
+    return (json_text){0};
+  return (json_text){.data = map_value_get_data(node).string,
+                     .length = map_value_get_length(node)};
+}
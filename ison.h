@@ -2,6 +2,7 @@
 #define ISON_H
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 
 typedef struct array array_t;
@@ -10,15 +11,30 @@ typedef struct hash_map hash_map;
 typedef struct map_value map_value;
 typedef enum map_value_type map_value_type;
 typedef map_value json_value;
+typedef struct json_document json_document;
+typedef struct json_key json_key;
+typedef struct json_key_table json_key_table;
+typedef struct json_parser json_parser;
+typedef struct json_context json_context;
+typedef struct json_ondemand json_ondemand;
+typedef struct json_tape json_tape;
+typedef struct json_path json_path;
 
 typedef union json_value_union {
   char *string;
-  int integer;
+  int64_t integer;
   void *ptr;
   double number;
   bool boolean;
 } json_data;
 
+// A TEXT value as stored: data is NUL-terminated for convenience, but length
+// is authoritative and data may contain NUL bytes from \u0000 escapes.
+typedef struct json_text {
+  const char *data;
+  size_t length;
+} json_text;
+
 enum map_value_type {
   UNKNOWN,
   DICT,
@@ -31,14 +47,245 @@ enum map_value_type {
   NULLS
 };
 
+// Hash function for object keys. ADAPTIVE hashes with the fast function and
+// moves a map to keyed SipHash-2-4 once its probe sequences look like a
+// collision attack.
+typedef enum json_key_hash {
+  JSON_HASH_SIPHASH24,
+  JSON_HASH_SIPHASH13,
+  JSON_HASH_WYHASH,
+  JSON_HASH_ADAPTIVE
+} json_key_hash;
+
+void json_set_key_hash(json_key_hash hash);
+
+// PRESIZE pre-scans the input to allocate every array and object at its
+// final size; it pays off for large containers. LAZY_NUMBERS keeps numbers
+// as their literal text and converts them on first read; the conversion is
+// cached atomically, so such documents can still be read from several
+// threads at once. UNORDERED lets json_parse_ndjson deliver documents as
+// soon as they are parsed.
+typedef enum json_parse_flags {
+  JSON_PARSE_DEFAULT = 0,
+  JSON_PARSE_PRESIZE = 1 << 0,
+  JSON_PARSE_LAZY_NUMBERS = 1 << 1,
+  JSON_PARSE_UNORDERED = 1 << 2
+} json_parse_flags;
+
 json_value *json_parse_file(FILE *f);
 
 json_value *json_parse_string(char *str);
 
+json_document *json_parse_document(char *str);
+
+json_document *json_parse_document_file(FILE *f);
+
+json_document *json_parse_string_insitu(char *buf, size_t len);
+
+json_document *json_parse_path(const char *path);
+
+// Parses a large top-level array or object on nthreads threads: its
+// elements are split into ranges parsed concurrently and joined into one
+// root. buf is only read and need not be NUL-terminated.
+json_document *json_parse_parallel(char *buf, size_t len, int nthreads,
+                                   json_parse_flags flags);
+
+// Push parser for a document that arrives in pieces of any size. feed
+// returns false once the input is known to be invalid; finish frees the
+// parser and returns the document, or NULL if it is incomplete or invalid.
+json_parser *json_parser_new();
+
+bool json_parser_feed(json_parser *parser, const char *chunk, size_t len);
+
+json_document *json_parser_finish(json_parser *parser);
+
+void json_parser_free(json_parser *parser);
+
+// Callbacks of the event parser, which builds no tree. Any of them may be
+// NULL; returning false stops the parse. Keys and strings are not
+// NUL-terminated and are only valid during the call.
+typedef struct json_handler {
+  bool (*object_start)(void *ctx);
+  bool (*object_end)(void *ctx);
+  bool (*array_start)(void *ctx);
+  bool (*array_end)(void *ctx);
+  bool (*key)(void *ctx, const char *key, size_t len);
+  bool (*string)(void *ctx, const char *str, size_t len);
+  bool (*integer)(void *ctx, int64_t integer);
+  bool (*number)(void *ctx, double number);
+  bool (*boolean)(void *ctx, bool boolean);
+  bool (*null)(void *ctx);
+} json_handler;
+
+bool json_parse_events(const char *str, size_t len, const json_handler *handler,
+                       void *ctx);
+
+bool json_parse_events_file(FILE *f, const json_handler *handler, void *ctx);
+
+// Reusable parser state. The stacks and structural index a parse needs keep
+// their capacity from one document to the next, and the position where the
+// last parse stopped is kept for error reporting. A context must not be used
+// by two threads at once; contexts on different threads are independent.
+json_context *json_context_new();
+
+void json_context_free(json_context *ctx);
+
+json_document *json_context_parse(json_context *ctx, char *str, size_t len,
+                                  json_parse_flags flags);
+
+void json_context_position(json_context *ctx, int *line, int *column);
+
+// Receives the document of one line of NDJSON input, or NULL if the line is
+// malformed, and owns it from then on. line counts from 1; blank lines are
+// skipped. Calls never overlap; returning false stops the parse.
+typedef bool (*json_ndjson_callback)(void *ctx, size_t line,
+                                     json_document *doc);
+
+bool json_parse_ndjson(const char *buf, size_t len, int nthreads,
+                       json_parse_flags flags, json_ndjson_callback callback,
+                       void *ctx);
+
+// On-demand parsing indexes the input and builds nothing up front. A cursor
+// marks a value in it: navigating skips whole subtrees without reading them
+// and json_cursor_value builds just the value under the cursor, which lives
+// until json_ondemand_free. Only what is visited is checked for errors. buf
+// is only read and must outlive the document.
+typedef struct json_cursor {
+  json_ondemand *doc;
+  uint64_t index;
+} json_cursor;
+
+json_ondemand *json_parse_ondemand(const char *buf, size_t len);
+
+void json_ondemand_free(json_ondemand *doc);
+
+json_cursor json_ondemand_root(json_ondemand *doc);
+
+bool json_cursor_find(json_cursor object, const char *key, size_t key_len,
+                      json_cursor *value);
+
+bool json_cursor_at(json_cursor array, size_t index, json_cursor *element);
+
+bool json_cursor_first(json_cursor array, json_cursor *element);
+
+bool json_cursor_next(json_cursor *element);
+
+map_value_type json_cursor_type(json_cursor cursor);
+
+// TEXT values without escapes, in the value and in any object or array
+// below it, are views into buf: they are not NUL-terminated, so read them
+// with json_value_text, and they are only valid while buf is.
+json_value *json_cursor_value(json_cursor cursor);
+
+// Immutable document laid out as one contiguous tape of 64-bit words in a
+// single allocation. Containers link to their ends, so skipping one takes a
+// single step. An iterator over an object visits its member values, and
+// json_tape_key gives the key of the member. Strings stay valid until
+// json_tape_free and are NUL-terminated.
+typedef struct json_tape_iter {
+  const json_tape *tape;
+  uint64_t index;
+  bool member;
+} json_tape_iter;
+
+json_tape *json_parse_tape(const char *str, size_t len);
+
+void json_tape_free(json_tape *tape);
+
+json_tape_iter json_tape_root(const json_tape *tape);
+
+map_value_type json_tape_type(json_tape_iter it);
+
+// Element or member count of a container. Counts up to 16,777,214 are
+// stored; larger ones are found by walking the container.
+size_t json_tape_length(json_tape_iter it);
+
+bool json_tape_child(json_tape_iter container, json_tape_iter *child);
+
+bool json_tape_next(json_tape_iter *it);
+
+json_text json_tape_key(json_tape_iter it);
+
+bool json_tape_find(json_tape_iter object, const char *key, size_t key_len,
+                    json_tape_iter *value);
+
+json_text json_tape_text(json_tape_iter it);
+
+bool json_tape_int64(json_tape_iter it, int64_t *integer);
+
+bool json_tape_double(json_tape_iter it, double *number);
+
+bool json_tape_bool(json_tape_iter it, bool *boolean);
+
+// Compiled query over a tree, such as "a.b[3].c[*].id" or "$['a.b'][0]":
+// dotted or quoted keys, array indices, and * for every element of an array
+// or every member value of an object. Compile once, evaluate on any number
+// of documents; a compiled path is immutable and may be shared by threads.
+// Returns NULL if the path is malformed.
+json_path *json_path_compile(const char *path);
+
+void json_path_free(json_path *path);
+
+// Returns the first match below root, or NULL if there is none.
+json_value *json_path_eval(json_value *root, const json_path *path);
+
+// Receives a match of the path in roots[doc]. Matches arrive in document
+// order; returning false stops the evaluation.
+typedef bool (*json_path_callback)(void *ctx, size_t doc, json_value *value);
+
+// Reports every match in each of count roots; NULL roots are skipped.
+// Returns false if the callback stopped it.
+bool json_path_eval_many(json_value *const *roots, size_t count,
+                         const json_path *path, json_path_callback callback,
+                         void *ctx);
+
+// Builds a document holding only the values at paths, in their places: the
+// objects and arrays leading to them keep just the members and elements on
+// some path, and array elements skipped before a kept one read as null, so
+// every path finds the same value as in a full parse. Nothing else is built
+// or checked. Keys are interned like in any other document. TEXT values
+// without escapes are views into buf and are not NUL-terminated; buf is
+// only read and must outlive the document.
+json_document *json_parse_projected(const char *buf, size_t len,
+                                    const char *const *paths, size_t count);
+
+json_value *json_document_root(json_document *doc);
+
+void json_document_free(json_document *doc);
+
+// Object keys of a document are interned: every object shares one copy of
+// each distinct key. A table made with json_key_table_new can be shared by
+// several documents; it must outlive them and is not thread-safe.
+json_key_table *json_key_table_new();
+
+void json_key_table_free(json_key_table *keys);
+
+json_document *json_parse_document_shared(char *str, json_key_table *keys);
+
+json_document *json_parse_document_flags(char *str, json_key_table *keys,
+                                         json_parse_flags flags);
+
+json_key_table *json_document_keys(json_document *doc);
+
+const json_key *json_key_find(json_key_table *keys, const char *key,
+                              size_t key_len);
+
 json_value *json_query(json_value *node, char *key);
 
+json_value *json_query_n(json_value *node, const char *key, size_t key_len);
+
+json_value *json_query_key(json_value *node, const json_key *key);
+
 map_value_type json_value_type(json_value *node);
 
 json_data json_value_data(json_value *node);
 
+json_text json_value_text(json_value *node);
+
+bool json_value_int64(json_value *node, int64_t *integer);
+
+bool json_value_double(json_value *node, double *number);
+
+json_text json_value_number_text(json_value *node);
+
 #endif
\ No newline at end of file
@@ -1,12 +1,248 @@
 #ifndef ISON_DATA_H
 #define ISON_DATA_H
 
+#include "ds.h"
 #include "ison.h"
 #include <inttypes.h>
+#include <string.h>
 
+// Values are built and read through the map_value_* functions below, so the
+// layout can be switched at build time.
+#ifndef ISON_NAN_BOXING
+
+// length holds the byte length of TEXT values and fills what would otherwise
+// be padding, so the struct stays 16 bytes.
 struct map_value {
   json_data value;
   map_value_type type;
+  uint32_t length;
+};
+
+static inline map_value_type map_value_get_type(const map_value *value) {
+  return value->type;
+}
+
+static inline json_data map_value_get_data(const map_value *value) {
+  return value->value;
+}
+
+static inline uint32_t map_value_get_length(const map_value *value) {
+  return value->length;
+}
+
+// length is that of a TEXT value or, when non-zero for a number, of the
+// literal of a lazy number whose record is data.ptr.
+static inline bool map_value_make(json_arena *arena, map_value_type type,
+                                  json_data data, uint32_t length,
+                                  map_value *value) {
+  (void)arena;
+  *value = (map_value){.value = data, .type = type, .length = length};
+  return true;
+}
+
+#else
+
+#include <zot.h>
+
+static_assert(sizeof(void *) == 8, "NaN-boxing needs 64-bit pointers");
+
+// One 64-bit word. Doubles are stored as themselves, with NaN made a
+// positive quiet NaN. Every other value sets the sign, exponent and quiet
+// bits, which no stored double does, and carries a 3-bit tag over a 48-bit
+// payload: a pointer, a small integer or a constant. Strings, integers that
+// do not fit 48 bits and lazy numbers point at a record in the arena.
+// All-zero bits are UNKNOWN, as in the unboxed layout, so zeroed memory
+// means the same in both; +0.0 is therefore boxed as a constant. Pointers
+// must fit the payload: ones with tag bits in their top 16, such as tagged
+// heap pointers on AArch64, are refused.
+struct map_value {
+  uint64_t bits;
+};
+
+#define MAP_BOX_MASK 0xfff8000000000000ULL
+#define MAP_BOX_TAG_SHIFT 48
+#define MAP_BOX_PAYLOAD_MASK ((1ULL << MAP_BOX_TAG_SHIFT) - 1)
+#define MAP_BOX_CANONICAL_NAN 0x7ff8000000000000ULL
+#define MAP_BOX_INT_MIN (-(1LL << 47))
+#define MAP_BOX_INT_MAX ((1LL << 47) - 1)
+
+enum map_box_tag {
+  BOX_DICT = 1,
+  BOX_LIST,
+  // Payload: a json_text record.
+  BOX_TEXT,
+  BOX_POINTER,
+  // Payload: the integer, sign-extended from 48 bits.
+  BOX_INTEGER,
+  // Payload: 0 for false, 1 for true, 2 for null, 3 for +0.0.
+  BOX_CONSTANT,
+  // Payload: a json_lazy_number record, converted already for an integer
+  // too wide to box.
+  BOX_NUMBER
 };
 
-#endif
\ No newline at end of file
+#define MAP_BOX_NULL 2
+#define MAP_BOX_ZERO 3
+
+static inline bool map_value_boxed(const map_value *value) {
+  return (value->bits & MAP_BOX_MASK) == MAP_BOX_MASK;
+}
+
+static inline enum map_box_tag map_value_tag(const map_value *value) {
+  return value->bits >> MAP_BOX_TAG_SHIFT & 7;
+}
+
+static inline void *map_value_pointer(const map_value *value) {
+  return (void *)(uintptr_t)(value->bits & MAP_BOX_PAYLOAD_MASK);
+}
+
+static inline map_value map_value_box(enum map_box_tag tag, uint64_t payload) {
+  uint64_t bits = MAP_BOX_MASK | (uint64_t)tag << MAP_BOX_TAG_SHIFT;
+  return (map_value){.bits = bits | (payload & MAP_BOX_PAYLOAD_MASK)};
+}
+
+static inline bool map_value_box_pointer(enum map_box_tag tag,
+                                         const void *pointer,
+                                         map_value *value) {
+  if ((uintptr_t)pointer & ~MAP_BOX_PAYLOAD_MASK) {
+    LOG_ERROR("Pointer %p does not fit a NaN-boxed value", pointer);
+    return false;
+  }
+  *value = map_value_box(tag, (uintptr_t)pointer);
+  return true;
+}
+
+static inline map_value_type map_value_get_type(const map_value *value) {
+  if (!value->bits)
+    return UNKNOWN;
+  if (!map_value_boxed(value))
+    return FLOATS;
+  switch (map_value_tag(value)) {
+  case BOX_DICT:
+    return DICT;
+  case BOX_LIST:
+    return LIST;
+  case BOX_TEXT:
+    return TEXT;
+  case BOX_POINTER:
+    return POINTER;
+  case BOX_INTEGER:
+    return INTEGERS;
+  case BOX_CONSTANT:
+    switch (value->bits & MAP_BOX_PAYLOAD_MASK) {
+    case MAP_BOX_NULL:
+      return NULLS;
+    case MAP_BOX_ZERO:
+      return FLOATS;
+    default:
+      return BOOLEANS;
+    }
+  case BOX_NUMBER:
+    return ((json_lazy_number *)map_value_pointer(value))->type;
+  default:
+    return UNKNOWN;
+  }
+}
+
+// A lazy number reads as its record, as in the unboxed layout.
+static inline json_data map_value_get_data(const map_value *value) {
+  json_data data = {0};
+  if (!map_value_boxed(value)) {
+    memcpy(&data.number, &value->bits, sizeof(data.number));
+    return data;
+  }
+  switch (map_value_tag(value)) {
+  case BOX_TEXT:
+    data.string = (char *)((json_text *)map_value_pointer(value))->data;
+    break;
+  case BOX_INTEGER:
+    data.integer = (int64_t)(value->bits << 16) >> 16;
+    break;
+  case BOX_CONSTANT:
+    // +0.0 and false both read as all-zero data.
+    data.boolean = (value->bits & MAP_BOX_PAYLOAD_MASK) == 1;
+    break;
+  case BOX_NUMBER: {
+    json_lazy_number *number = map_value_pointer(value);
+    if (number->length)
+      data.ptr = number;
+    else
+      data = number->value;
+  } break;
+  default:
+    data.ptr = map_value_pointer(value);
+    break;
+  }
+  return data;
+}
+
+static inline uint32_t map_value_get_length(const map_value *value) {
+  if (!map_value_boxed(value))
+    return 0;
+  if (map_value_tag(value) == BOX_TEXT)
+    return ((json_text *)map_value_pointer(value))->length;
+  if (map_value_tag(value) == BOX_NUMBER)
+    return ((json_lazy_number *)map_value_pointer(value))->length;
+  return 0;
+}
+
+static inline bool map_value_make(json_arena *arena, map_value_type type,
+                                  json_data data, uint32_t length,
+                                  map_value *value) {
+  switch (type) {
+  case UNKNOWN:
+    value->bits = 0;
+    return true;
+  case DICT:
+    return map_value_box_pointer(BOX_DICT, data.ptr, value);
+  case LIST:
+    return map_value_box_pointer(BOX_LIST, data.ptr, value);
+  case POINTER:
+    return map_value_box_pointer(BOX_POINTER, data.ptr, value);
+  case BOOLEANS:
+    *value = map_value_box(BOX_CONSTANT, data.boolean);
+    return true;
+  case NULLS:
+    *value = map_value_box(BOX_CONSTANT, MAP_BOX_NULL);
+    return true;
+  case TEXT: {
+    json_text *text = arena_alloc(arena, sizeof(*text));
+    if (!text) {
+      LOG_ERROR("Failed to allocate string record");
+      return false;
+    }
+    *text = (json_text){.data = data.string, .length = length};
+    return map_value_box_pointer(BOX_TEXT, text, value);
+  }
+  default:
+    break;
+  }
+
+  if (length) {
+    return map_value_box_pointer(BOX_NUMBER, data.ptr, value);
+  } else if (type == FLOATS) {
+    if (data.number != data.number)
+      value->bits = MAP_BOX_CANONICAL_NAN;
+    else
+      memcpy(&value->bits, &data.number, sizeof(value->bits));
+    if (!value->bits)
+      *value = map_value_box(BOX_CONSTANT, MAP_BOX_ZERO);
+  } else if (data.integer >= MAP_BOX_INT_MIN &&
+             data.integer <= MAP_BOX_INT_MAX) {
+    *value = map_value_box(BOX_INTEGER, (uint64_t)data.integer);
+  } else {
+    json_lazy_number *number = arena_alloc(arena, sizeof(*number));
+    if (!number) {
+      LOG_ERROR("Failed to allocate integer record");
+      return false;
+    }
+    *number = (json_lazy_number){
+        .value = data, .state = LAZY_CONVERTED, .type = INTEGERS};
+    return map_value_box_pointer(BOX_NUMBER, number, value);
+  }
+  return true;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#include "ds.h"
+#include <siphash.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zot.h>
+
+#ifndef ISON_DEFAULT_HASH
+#define ISON_DEFAULT_HASH JSON_HASH_ADAPTIVE
+#endif
+
+int siphash13(const void *in, const size_t inlen, const void *k, uint8_t *out,
+              const size_t outlen);
+
+static uint8_t sip_key[16];
+static uint64_t wy_seed;
+static const uint64_t wy_secret[4] = {0xa0761d6478bd642fULL,
+                                      0xe7037ed1a0b428dbULL,
+                                      0x8ebc6af09c88c6e3ULL,
+                                      0x589965cc75374cc3ULL};
+
+static json_key_hash default_hash = ISON_DEFAULT_HASH;
+
+void __attribute__((__constructor__)) init() {
+  arc4random_buf(sip_key, sizeof(sip_key));
+  arc4random_buf(&wy_seed, sizeof(wy_seed));
+}
+
+// Applies to maps created afterwards; existing maps keep their function.
+void json_set_key_hash(json_key_hash hash) { default_hash = hash; }
+
+json_key_hash json_get_key_hash() { return default_hash; }
+
+// Replaces *a and *b with the low and high halves of their 128-bit product.
+static inline void wy_mum128(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wy_mum(uint64_t a, uint64_t b) {
+  wy_mum128(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t wy_read8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wy_read4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t wy_read3(const uint8_t *p, size_t k) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+// wyhash-style multiply-mix hash. Keys of up to 16 bytes, the common case
+// for JSON, take two multiplications.
+static uint64_t wyhash(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint64_t *secret = wy_secret;
+  seed ^= wy_mum(seed ^ secret[0], secret[1]);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+      b = (wy_read4(p + len - 4) << 32) |
+          wy_read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wy_read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wy_mum(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+        see1 = wy_mum(wy_read8(p + 16) ^ secret[2], wy_read8(p + 24) ^ see1);
+        see2 = wy_mum(wy_read8(p + 32) ^ secret[3], wy_read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy_mum(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wy_read8(p + i - 16);
+    b = wy_read8(p + i - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  wy_mum128(&a, &b);
+  return wy_mum(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+uint64_t compute_hash(json_key_hash hash, const char *string, uint32_t len) {
+  switch (hash) {
+  case JSON_HASH_SIPHASH13: {
+    uint64_t digest;
+    siphash13(string, len, sip_key, (uint8_t *)&digest, sizeof(digest));
+    return digest;
+  }
+  case JSON_HASH_WYHASH:
+  case JSON_HASH_ADAPTIVE:
+    return wyhash(string, len, wy_seed);
+  case JSON_HASH_SIPHASH24:
+  default: {
+    uint64_t digest[2];
+    siphash(string, len, sip_key, (uint8_t *)digest, sizeof(digest));
+    return digest[0] ^ digest[1];
+  }
+  }
+}
@@ -0,0 +1,308 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+#include <zot.h>
+
+#include "ds.h"
+
+// Lines are grouped into batches of about this many bytes, the unit of work
+// a thread takes or steals.
+#define NDJSON_BATCH_SIZE (64 * 1024)
+
+typedef struct ndjson_entry {
+  size_t line;
+  json_document *doc;
+} ndjson_entry;
+
+typedef struct ndjson_batch {
+  const char *start;
+  const char *end;
+  size_t first_line;
+  size_t lines;
+  // Documents of the non-blank lines, held until the batch is delivered.
+  ndjson_entry *entries;
+  size_t count;
+  bool done;
+} ndjson_batch;
+
+// Batches [head, tail) not yet taken. The owner works from the head and
+// idle threads steal from the tail, so both ends rarely contend.
+typedef struct ndjson_queue {
+  mtx_t lock;
+  size_t head;
+  size_t tail;
+} ndjson_queue;
+
+typedef struct ndjson_job {
+  ndjson_batch *batches;
+  size_t batch_count;
+  ndjson_queue *queues;
+  int workers;
+  json_parse_flags flags;
+  json_ndjson_callback callback;
+  void *ctx;
+  // Guards delivery: only one thread delivers at a time, the others just
+  // mark their batches done and carry on parsing.
+  mtx_t lock;
+  bool delivering;
+  // Ordered delivery waits for next_batch; unordered delivery takes done
+  // batches from ready in the order they finished.
+  size_t next_batch;
+  size_t *ready;
+  size_t ready_head;
+  size_t ready_tail;
+  atomic_bool stopped;
+  atomic_bool failed;
+} ndjson_job;
+
+typedef struct ndjson_worker {
+  ndjson_job *job;
+  int id;
+} ndjson_worker;
+
+// Cuts the input into batches at line boundaries and numbers their lines.
+static bool ndjson_split(ndjson_job *job, const char *buf, size_t len) {
+  job->batches = zcalloc(len / NDJSON_BATCH_SIZE + 1, sizeof(*job->batches));
+  if (!job->batches) {
+    LOG_ERROR("Failed to allocate NDJSON batches");
+    return false;
+  }
+
+  const char *c = buf;
+  const char *end = buf + len;
+  size_t line = 1;
+  while (c < end) {
+    ndjson_batch *batch = &job->batches[job->batch_count++];
+    batch->start = c;
+    batch->first_line = line;
+    const char *limit =
+        (size_t)(end - c) > NDJSON_BATCH_SIZE ? c + NDJSON_BATCH_SIZE : end;
+    while (c < limit) {
+      const char *newline = memchr(c, '\n', end - c);
+      c = newline ? newline + 1 : end;
+      batch->lines++;
+    }
+    batch->end = c;
+    line += batch->lines;
+  }
+  return true;
+}
+
+static bool ndjson_blank(const char *c, const char *end) {
+  for (; c < end; c++)
+    if (*c != ' ' && *c != '\t' && *c != '\r')
+      return false;
+  return true;
+}
+
+// The input is only read; json_context_parse takes it as char * because in
+// situ parsing writes to it.
+static void ndjson_parse_batch(ndjson_job *job, json_context *parser,
+                               ndjson_batch *batch) {
+  batch->entries = zmalloc(batch->lines * sizeof(*batch->entries));
+  if (!batch->entries) {
+    LOG_ERROR("Failed to allocate NDJSON documents");
+    atomic_store(&job->failed, true);
+    return;
+  }
+
+  const char *c = batch->start;
+  for (size_t i = 0; i < batch->lines && !atomic_load(&job->stopped); i++) {
+    const char *newline = memchr(c, '\n', batch->end - c);
+    const char *line_end = newline ? newline : batch->end;
+    if (!ndjson_blank(c, line_end)) {
+      ndjson_entry *entry = &batch->entries[batch->count++];
+      entry->line = batch->first_line + i;
+      entry->doc =
+          json_context_parse(parser, (char *)c, line_end - c, job->flags);
+      if (!entry->doc) {
+        LOG_ERROR("Malformed document on line %zu", entry->line);
+        atomic_store(&job->failed, true);
+      }
+    }
+    c = line_end + 1;
+  }
+}
+
+static void ndjson_release_batch(ndjson_batch *batch) {
+  for (size_t i = 0; i < batch->count; i++)
+    json_document_free(batch->entries[i].doc);
+  zfree(batch->entries);
+  batch->entries = NULL;
+  batch->count = 0;
+}
+
+static void ndjson_deliver_batch(ndjson_job *job, ndjson_batch *batch) {
+  for (size_t i = 0; i < batch->count; i++) {
+    ndjson_entry *entry = &batch->entries[i];
+    if (atomic_load(&job->stopped))
+      break;
+    if (!job->callback(job->ctx, entry->line, entry->doc))
+      atomic_store(&job->stopped, true);
+    entry->doc = NULL;
+  }
+  ndjson_release_batch(batch);
+}
+
+static ndjson_batch *ndjson_next_ready(ndjson_job *job) {
+  if (job->flags & JSON_PARSE_UNORDERED)
+    return job->ready_head < job->ready_tail
+               ? &job->batches[job->ready[job->ready_head++]]
+               : NULL;
+  if (job->next_batch < job->batch_count &&
+      job->batches[job->next_batch].done)
+    return &job->batches[job->next_batch++];
+  return NULL;
+}
+
+// Marks the batch done and, unless another thread is already at it, delivers
+// every batch that has become deliverable. The lock is dropped around the
+// callbacks so the other threads are never held up by them.
+static void ndjson_finish_batch(ndjson_job *job, ndjson_batch *batch) {
+  mtx_lock(&job->lock);
+  batch->done = true;
+  if (job->flags & JSON_PARSE_UNORDERED)
+    job->ready[job->ready_tail++] = batch - job->batches;
+  if (job->delivering) {
+    mtx_unlock(&job->lock);
+    return;
+  }
+
+  job->delivering = true;
+  ndjson_batch *ready;
+  while ((ready = ndjson_next_ready(job))) {
+    mtx_unlock(&job->lock);
+    ndjson_deliver_batch(job, ready);
+    mtx_lock(&job->lock);
+  }
+  job->delivering = false;
+  mtx_unlock(&job->lock);
+}
+
+static ndjson_batch *ndjson_take(ndjson_job *job, int id) {
+  size_t index = SIZE_MAX;
+  ndjson_queue *own = &job->queues[id];
+  mtx_lock(&own->lock);
+  if (own->head < own->tail)
+    index = own->head++;
+  mtx_unlock(&own->lock);
+
+  for (int i = 1; index == SIZE_MAX && i < job->workers; i++) {
+    ndjson_queue *victim = &job->queues[(id + i) % job->workers];
+    mtx_lock(&victim->lock);
+    if (victim->head < victim->tail)
+      index = --victim->tail;
+    mtx_unlock(&victim->lock);
+  }
+  return index == SIZE_MAX ? NULL : &job->batches[index];
+}
+
+// Each worker keeps one parser context for all the lines it parses.
+static int ndjson_work(void *arg) {
+  ndjson_worker *worker = arg;
+  ndjson_job *job = worker->job;
+  json_context *parser = json_context_new();
+  if (!parser) {
+    atomic_store(&job->failed, true);
+    return 0;
+  }
+
+  ndjson_batch *batch;
+  while (!atomic_load(&job->stopped) &&
+         (batch = ndjson_take(job, worker->id))) {
+    ndjson_parse_batch(job, parser, batch);
+    ndjson_finish_batch(job, batch);
+  }
+  json_context_free(parser);
+  return 0;
+}
+
+static bool ndjson_start(ndjson_job *job, int workers) {
+  job->queues = zcalloc(workers, sizeof(*job->queues));
+  if (job->flags & JSON_PARSE_UNORDERED)
+    job->ready = zcalloc(job->batch_count, sizeof(*job->ready));
+  if (!job->queues || (job->flags & JSON_PARSE_UNORDERED && !job->ready)) {
+    LOG_ERROR("Failed to allocate NDJSON work queues");
+    return false;
+  }
+  for (int i = 0; i < workers; i++) {
+    job->queues[i].head = job->batch_count * i / workers;
+    job->queues[i].tail = job->batch_count * (i + 1) / workers;
+    if (mtx_init(&job->queues[i].lock, mtx_plain) != thrd_success) {
+      LOG_ERROR("Failed to create NDJSON queue lock");
+      job->workers = i;
+      return false;
+    }
+  }
+  job->workers = workers;
+  if (mtx_init(&job->lock, mtx_plain) != thrd_success) {
+    LOG_ERROR("Failed to create NDJSON delivery lock");
+    return false;
+  }
+  return true;
+}
+
+// Splits the input into lines and parses them on nthreads threads, the
+// calling thread included. Each thread starts on its own contiguous share of
+// the batches and steals from the others once that runs out. A thread that
+// cannot be started only costs parallelism: its share is stolen.
+bool json_parse_ndjson(const char *buf, size_t len, int nthreads,
+                       json_parse_flags flags, json_ndjson_callback callback,
+                       void *ctx) {
+  if (!buf || !callback) {
+    LOG_ERROR("Received NULL input buffer or callback");
+    return false;
+  }
+
+  ndjson_job job = {.flags = flags, .callback = callback, .ctx = ctx};
+  atomic_init(&job.stopped, false);
+  atomic_init(&job.failed, false);
+  if (!ndjson_split(&job, buf, len))
+    return false;
+  if (!job.batch_count) {
+    zfree(job.batches);
+    return true;
+  }
+
+  if (nthreads < 1)
+    nthreads = 1;
+  if ((size_t)nthreads > job.batch_count)
+    nthreads = job.batch_count;
+
+  bool started = ndjson_start(&job, nthreads);
+  ndjson_worker *workers = zcalloc(nthreads, sizeof(*workers));
+  thrd_t *threads = zcalloc(nthreads, sizeof(*threads));
+  bool *running = zcalloc(nthreads, sizeof(*running));
+  // The delivery lock exists once the job started, whether or not the
+  // workers can run, and is destroyed with the rest below.
+  bool ran = started && workers && threads && running;
+  if (started && !ran)
+    LOG_ERROR("Failed to allocate NDJSON workers");
+
+  if (ran) {
+    for (int i = 0; i < nthreads; i++)
+      workers[i] = (ndjson_worker){.job = &job, .id = i};
+    for (int i = 1; i < nthreads; i++)
+      running[i] =
+          thrd_create(&threads[i], ndjson_work, &workers[i]) == thrd_success;
+    ndjson_work(&workers[0]);
+    for (int i = 1; i < nthreads; i++)
+      if (running[i])
+        thrd_join(threads[i], NULL);
+  }
+  if (started)
+    mtx_destroy(&job.lock);
+
+  // Whatever a stop left undelivered is dropped here.
+  for (size_t i = 0; i < job.batch_count; i++)
+    ndjson_release_batch(&job.batches[i]);
+  for (int i = 0; i < job.workers; i++)
+    mtx_destroy(&job.queues[i].lock);
+  zfree(running);
+  zfree(threads);
+  zfree(workers);
+  zfree(job.ready);
+  zfree(job.queues);
+  zfree(job.batches);
+  return ran && !atomic_load(&job.failed) && !atomic_load(&job.stopped);
+}
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <float.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+#include "pow10_table.h"
+
+// More significant digits than this may not fit a uint64_t mantissa.
+#define MAX_MANTISSA_DIGITS 19
+// Exponents beyond this are clamped; they overflow or underflow anyway.
+#define MAX_EXPONENT 100000
+
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline void mul64(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  *lo = (uint64_t)r;
+  *hi = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  *lo = t + (rm1 << 32);
+  c += *lo < t;
+  *hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+// Exact when both the mantissa and the power of ten are exact doubles, since
+// IEEE multiplication and division round correctly (Clinger's fast path).
+static bool clinger(uint64_t mantissa, int64_t exp10, bool negative,
+                    double *number) {
+#if FLT_EVAL_METHOD == 0
+  static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+  if (mantissa > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+    return false;
+  double d = (double)mantissa;
+  d = exp10 < 0 ? d / powers[-exp10] : d * powers[exp10];
+  *number = negative ? -d : d;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Eisel-Lemire: multiplies the normalized mantissa by a 128-bit approximation
+// of 10^exp10 and keeps the top 54 bits. Gives up, returning false, whenever
+// the truncated product cannot decide the rounding or the result would be
+// subnormal or infinite.
+static bool eisel_lemire(uint64_t mantissa, int64_t exp10, bool negative,
+                         double *number) {
+  if (!mantissa) {
+    *number = negative ? -0.0 : 0.0;
+    return true;
+  }
+  if (exp10 < JSON_POW10_MIN || exp10 > JSON_POW10_MAX)
+    return false;
+
+  const uint64_t *power = json_pow10_table[exp10 - JSON_POW10_MIN];
+  int clz = __builtin_clzll(mantissa);
+  mantissa <<= clz;
+  uint64_t exp2 = (uint64_t)(((217706 * exp10) >> 16) + 64 + 1023) - clz;
+
+  uint64_t hi, lo;
+  mul64(mantissa, power[0], &hi, &lo);
+  // The low 9 bits are all ones and the product may still carry into them:
+  // bring in the low word of the power to find out.
+  if ((hi & 0x1ff) == 0x1ff && lo + mantissa < mantissa) {
+    uint64_t hi2, lo2;
+    mul64(mantissa, power[1], &hi2, &lo2);
+    uint64_t merged_hi = hi, merged_lo = lo + hi2;
+    if (merged_lo < lo)
+      merged_hi++;
+    if ((merged_hi & 0x1ff) == 0x1ff && merged_lo + 1 == 0 &&
+        lo2 + mantissa < mantissa)
+      return false;
+    hi = merged_hi;
+    lo = merged_lo;
+  }
+
+  uint64_t msb = hi >> 63;
+  uint64_t result = hi >> (msb + 9);
+  exp2 -= 1 ^ msb;
+
+  // Exactly halfway between two doubles: round-half-even needs more digits.
+  if (!lo && !(hi & 0x1ff) && (result & 3) == 1)
+    return false;
+
+  result += result & 1;
+  result >>= 1;
+  if (result >> 53) {
+    result >>= 1;
+    exp2++;
+  }
+  if (exp2 - 1 >= 0x7ff - 1)
+    return false;
+
+  uint64_t bits = exp2 << 52 | (result & ((1ULL << 52) - 1));
+  if (negative)
+    bits |= 1ULL << 63;
+  memcpy(number, &bits, sizeof(*number));
+  return true;
+}
+
+// Last resort for literals the fast paths decline. strtod honours the
+// locale's decimal point, so the copy gets that character instead of '.'.
+static bool strtod_fallback(const char *start, size_t span, double *number) {
+  char local[64];
+  char *literal = span < sizeof(local) ? local : zmalloc(span + 1);
+  if (!literal)
+    return false;
+  memcpy(literal, start, span);
+  literal[span] = 0;
+
+  char *dot = memchr(literal, '.', span);
+  if (dot)
+    *dot = *localeconv()->decimal_point;
+
+  char *endptr;
+  errno = 0;
+  *number = strtod(literal, &endptr);
+  bool valid = (size_t)(endptr - literal) == span && errno != ERANGE;
+  if (literal != local)
+    zfree(literal);
+  return valid;
+}
+
+// JSON allows a zero only as the whole integer part, so 007 and -01 are
+// malformed.
+static inline bool has_leading_zero(const char *c, const char *end) {
+  return end - c > 1 && c[0] == '0' && is_digit(c[1]);
+}
+
+// Checks the literal at c against the same grammar as json_scan_number and
+// reports the type it converts to, without converting it.
+size_t json_span_number(const char *c, const char *end, map_value_type *type) {
+  const char *start = c;
+  bool negative = c < end && *c == '-';
+  c += negative;
+
+  const char *int_start = c;
+  if (has_leading_zero(c, end))
+    return 0;
+  while (c < end && *c == '0')
+    c++;
+  const char *significant = c;
+  while (c < end && is_digit(*c))
+    c++;
+  if (c == int_start)
+    return 0;
+  size_t digits = c - significant;
+
+  bool is_float = false;
+  if (c < end && *c == '.') {
+    is_float = true;
+    const char *frac_start = ++c;
+    while (c < end && is_digit(*c))
+      c++;
+    if (c == frac_start)
+      return 0;
+  }
+  if (c < end && (*c == 'e' || *c == 'E')) {
+    is_float = true;
+    c++;
+    if (c < end && (*c == '-' || *c == '+'))
+      c++;
+    const char *exp_start = c;
+    while (c < end && is_digit(*c))
+      c++;
+    if (c == exp_start)
+      return 0;
+  }
+
+  if (is_float || digits > MAX_MANTISSA_DIGITS || (negative && !digits))
+    *type = FLOATS;
+  else if (digits == MAX_MANTISSA_DIGITS)
+    *type = memcmp(significant,
+                   negative ? "9223372036854775808" : "9223372036854775807",
+                   MAX_MANTISSA_DIGITS) <= 0
+                ? INTEGERS
+                : FLOATS;
+  else
+    *type = INTEGERS;
+  return c - start;
+}
+
+// Scans the number literal at c without reading at or past end. Literals
+// without fraction or exponent that fit an int64_t become INTEGERS, the rest
+// FLOATS. Returns the length of the literal, or 0 if it is malformed or out
+// of range.
+size_t json_scan_number(const char *c, const char *end, json_data *value,
+                        map_value_type *type) {
+  const char *start = c;
+  bool negative = c < end && *c == '-';
+  c += negative;
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int64_t exp10 = 0;
+  const char *int_start = c;
+  if (has_leading_zero(c, end))
+    return 0;
+  for (; c < end && is_digit(*c); c++) {
+    if (digits < MAX_MANTISSA_DIGITS) {
+      mantissa = mantissa * 10 + (*c - '0');
+      digits += digits || *c != '0';
+    } else {
+      exp10++;
+      digits++;
+    }
+  }
+  if (c == int_start)
+    return 0;
+
+  bool is_float = false;
+  if (c < end && *c == '.') {
+    is_float = true;
+    const char *frac_start = ++c;
+    for (; c < end && is_digit(*c); c++) {
+      if (digits < MAX_MANTISSA_DIGITS) {
+        mantissa = mantissa * 10 + (*c - '0');
+        digits += digits || *c != '0';
+        exp10--;
+      } else {
+        digits++;
+      }
+    }
+    if (c == frac_start)
+      return 0;
+  }
+
+  if (c < end && (*c == 'e' || *c == 'E')) {
+    is_float = true;
+    c++;
+    bool exp_negative = false;
+    if (c < end && (*c == '-' || *c == '+'))
+      exp_negative = *c++ == '-';
+    const char *exp_start = c;
+    int64_t exponent = 0;
+    for (; c < end && is_digit(*c); c++)
+      if (exponent < MAX_EXPONENT)
+        exponent = exponent * 10 + (*c - '0');
+    if (c == exp_start)
+      return 0;
+    exp10 += exp_negative ? -exponent : exponent;
+  }
+
+  size_t span = c - start;
+  bool truncated = digits > MAX_MANTISSA_DIGITS;
+
+  if (!is_float && !truncated && !exp10) {
+    if (!negative && mantissa <= INT64_MAX) {
+      value->integer = (int64_t)mantissa;
+      *type = INTEGERS;
+      return span;
+    }
+    // -0 stays a float so its sign survives.
+    if (negative && mantissa && mantissa <= (uint64_t)INT64_MAX + 1) {
+      value->integer = (int64_t)(0 - mantissa);
+      *type = INTEGERS;
+      return span;
+    }
+  }
+
+  *type = FLOATS;
+  if (!truncated && (clinger(mantissa, exp10, negative, &value->number) ||
+                     eisel_lemire(mantissa, exp10, negative, &value->number)))
+    return span;
+  return strtod_fallback(start, span, &value->number) ? span : 0;
+}
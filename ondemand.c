@@ -0,0 +1,447 @@
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+#include "ison_data.h"
+#include "structural.h"
+
+// Raw input with its structural index. Nothing is parsed up front: cursors
+// walk the index, and only the values asked for are ever built.
+struct json_ondemand {
+  const char *buf;
+  size_t len;
+  json_structural_index index;
+  // Values built by json_cursor_value; they live as long as the document.
+  json_arena arena;
+  // Keys with escapes are decoded here to be compared, then forgotten.
+  json_arena scratch;
+};
+
+static inline char ondemand_char(json_ondemand *doc, uint64_t i) {
+  return doc->buf[doc->index.positions[i]];
+}
+
+// Tells whether position i can start a value.
+static inline bool ondemand_is_value(json_ondemand *doc, uint64_t i) {
+  if (i >= doc->index.count)
+    return false;
+  char c = ondemand_char(doc, i);
+  return c != '}' && c != ']' && c != ',' && c != ':';
+}
+
+// Returns the position just past the value at i. A container is skipped by
+// counting brackets over the index, so none of its bytes are read; anything
+// else takes one position. An unclosed container runs to the end.
+static uint64_t ondemand_skip(json_ondemand *doc, uint64_t i) {
+  char c = ondemand_char(doc, i);
+  if (c != '{' && c != '[')
+    return i + 1;
+
+  uint64_t depth = 0;
+  for (; i < doc->index.count; i++) {
+    c = ondemand_char(doc, i);
+    if (c == '{' || c == '[')
+      depth++;
+    else if ((c == '}' || c == ']') && !--depth)
+      return i + 1;
+  }
+  return i;
+}
+
+// Builds the value at positions [first, next) into arena. The value ends
+// where the next position starts, or with the input. Object keys are
+// interned in keys when it is set.
+static json_value *ondemand_build(json_ondemand *doc, uint64_t first,
+                                  uint64_t next, json_arena *arena,
+                                  hash_map *keys) {
+  // The input is only read; the tokenizer takes char * because in situ
+  // parsing writes to it.
+  char *string = (char *)doc->buf;
+  const uint32_t *positions = doc->index.positions;
+  char *end = next < doc->index.count ? string + positions[next]
+                                      : string + doc->len;
+  return json_parse_indexed_value(string, string + positions[first], end,
+                                  positions + first, next - first, arena,
+                                  keys);
+}
+
+// Most keys have no escapes and are read where they lie; the others are
+// decoded into the scratch arena, so they last until it is reset.
+static json_text ondemand_key_text(json_ondemand *doc, uint64_t i) {
+  const char *start = doc->buf + doc->index.positions[i] + 1;
+  const char *end = doc->buf + doc->len;
+  size_t run = json_scan_string_run(start, end);
+  if (start + run < end && start[run] == '"')
+    return (json_text){.data = start, .length = run};
+
+  json_value *value = ondemand_build(doc, i, i + 1, &doc->scratch, NULL);
+  return value ? json_value_text(value) : (json_text){};
+}
+
+static bool ondemand_key_equals(json_ondemand *doc, uint64_t i,
+                                const char *key, size_t key_len) {
+  json_text text = ondemand_key_text(doc, i);
+  bool equal = text.data && text.length == key_len &&
+               !memcmp(text.data, key, key_len);
+  arena_reset(&doc->scratch);
+  return equal;
+}
+
+json_ondemand *json_parse_ondemand(const char *buf, size_t len) {
+  if (!buf) {
+    LOG_ERROR("Received NULL input buffer");
+    return NULL;
+  }
+
+  json_ondemand *doc = zcalloc(1, sizeof(*doc));
+  if (!doc) {
+    LOG_ERROR("Failed to allocate on-demand document");
+    return NULL;
+  }
+  doc->buf = buf;
+  doc->len = len;
+  arena_init(&doc->arena);
+  arena_init(&doc->scratch);
+
+  if (!json_structural_index_build(buf, len, &doc->index)) {
+    json_ondemand_free(doc);
+    return NULL;
+  }
+  // Brackets inside comments are indexed too and would break skipping.
+  if (doc->index.has_comments) {
+    LOG_ERROR("Comments are not supported by on-demand parsing");
+    json_ondemand_free(doc);
+    return NULL;
+  }
+  if (!doc->index.count) {
+    LOG_ERROR("Input holds no value");
+    json_ondemand_free(doc);
+    return NULL;
+  }
+  return doc;
+}
+
+void json_ondemand_free(json_ondemand *doc) {
+  if (!doc)
+    return;
+  json_structural_index_release(&doc->index);
+  arena_release(&doc->arena);
+  arena_release(&doc->scratch);
+  zfree(doc);
+}
+
+json_cursor json_ondemand_root(json_ondemand *doc) {
+  return (json_cursor){.doc = doc, .index = 0};
+}
+
+// Walks the members of the object in order, skipping the value of every key
+// that does not match.
+bool json_cursor_find(json_cursor object, const char *key, size_t key_len,
+                      json_cursor *value) {
+  json_ondemand *doc = object.doc;
+  uint64_t i = object.index;
+  if (!doc || i >= doc->index.count || ondemand_char(doc, i) != '{')
+    return false;
+
+  uint64_t count = doc->index.count;
+  i++;
+  while (i + 2 < count && ondemand_char(doc, i) == '"' &&
+         ondemand_char(doc, i + 1) == ':' && ondemand_is_value(doc, i + 2)) {
+    if (ondemand_key_equals(doc, i, key, key_len)) {
+      *value = (json_cursor){.doc = doc, .index = i + 2};
+      return true;
+    }
+    i = ondemand_skip(doc, i + 2);
+    if (i >= count || ondemand_char(doc, i) != ',')
+      break;
+    i++;
+  }
+
+  if (i >= count || ondemand_char(doc, i) != '}')
+    LOG_ERROR("Malformed object at offset %" PRIu32,
+              doc->index.positions[object.index]);
+  return false;
+}
+
+bool json_cursor_at(json_cursor array, size_t index, json_cursor *element) {
+  if (!json_cursor_first(array, element))
+    return false;
+  for (size_t i = 0; i < index; i++)
+    if (!json_cursor_next(element))
+      return false;
+  return true;
+}
+
+bool json_cursor_first(json_cursor array, json_cursor *element) {
+  json_ondemand *doc = array.doc;
+  if (!doc || array.index >= doc->index.count ||
+      ondemand_char(doc, array.index) != '[' ||
+      !ondemand_is_value(doc, array.index + 1))
+    return false;
+  *element = (json_cursor){.doc = doc, .index = array.index + 1};
+  return true;
+}
+
+bool json_cursor_next(json_cursor *element) {
+  json_ondemand *doc = element->doc;
+  if (!doc || element->index >= doc->index.count)
+    return false;
+  uint64_t i = ondemand_skip(doc, element->index);
+  if (i >= doc->index.count || ondemand_char(doc, i) != ',' ||
+      !ondemand_is_value(doc, i + 1))
+    return false;
+  element->index = i + 1;
+  return true;
+}
+
+// Judged from the first bytes only; the value may still turn out malformed
+// when it is built.
+map_value_type json_cursor_type(json_cursor cursor) {
+  json_ondemand *doc = cursor.doc;
+  if (!doc || cursor.index >= doc->index.count)
+    return UNKNOWN;
+
+  const char *c = doc->buf + doc->index.positions[cursor.index];
+  switch (*c) {
+  case '{':
+    return DICT;
+  case '[':
+    return LIST;
+  case '"':
+    return TEXT;
+  case 't':
+  case 'f':
+    return BOOLEANS;
+  case 'n':
+    return NULLS;
+  default: {
+    map_value_type type;
+    return json_span_number(c, doc->buf + doc->len, &type) ? type : UNKNOWN;
+  }
+  }
+}
+
+json_value *json_cursor_value(json_cursor cursor) {
+  json_ondemand *doc = cursor.doc;
+  if (!doc || cursor.index >= doc->index.count)
+    return NULL;
+  return ondemand_build(doc, cursor.index, ondemand_skip(doc, cursor.index),
+                        &doc->arena, NULL);
+}
+
+typedef struct ondemand_projection {
+  json_ondemand *doc;
+  json_path *const *paths;
+  size_t count;
+  // The paths still followed at each depth, count slots per depth.
+  uint32_t *active;
+  json_arena *arena;
+  hash_map *keys;
+} ondemand_projection;
+
+static bool ondemand_project(ondemand_projection *projection, uint64_t i,
+                             uint32_t depth, const uint32_t *active, size_t n,
+                             bool keep, uint64_t *next, json_value **value);
+
+// Collects the paths of active whose step at depth selects the key or the
+// index of a child.
+static size_t ondemand_select(ondemand_projection *projection, uint32_t depth,
+                              const uint32_t *active, size_t n,
+                              json_text key, uint64_t index,
+                              uint32_t *selected) {
+  size_t count = 0;
+  for (size_t k = 0; k < n; k++) {
+    const json_path_step *step = &projection->paths[active[k]]->steps[depth];
+    if (step->kind == PATH_WILDCARD ||
+        (key.data && step->kind == PATH_KEY && step->key_len == key.length &&
+         !memcmp(step->key, key.data, key.length)) ||
+        (!key.data && step->kind == PATH_INDEX && step->index == index))
+      selected[count++] = active[k];
+  }
+  return count;
+}
+
+static json_value *ondemand_container(json_arena *arena, map_value_type type) {
+  void *container = type == DICT ? (void *)create_hash_map_in(arena)
+                                 : (void *)create_array_in(arena);
+  json_value *value = arena_alloc(arena, sizeof(*value));
+  if (!container || !value ||
+      !map_value_make(arena, type, (json_data){.ptr = container}, 0, value)) {
+    LOG_ERROR("Failed to allocate projected container");
+    return NULL;
+  }
+  return value;
+}
+
+static bool ondemand_project_object(ondemand_projection *projection,
+                                    uint64_t i, uint32_t depth,
+                                    const uint32_t *active, size_t n,
+                                    uint64_t *next, json_value **value) {
+  json_ondemand *doc = projection->doc;
+  uint64_t count = doc->index.count;
+  uint64_t start = i;
+  uint32_t *selected = projection->active + (depth + 1) * projection->count;
+
+  i++;
+  while (i + 2 < count && ondemand_char(doc, i) == '"' &&
+         ondemand_char(doc, i + 1) == ':' && ondemand_is_value(doc, i + 2)) {
+    json_text key = ondemand_key_text(doc, i);
+    if (!key.data)
+      return false;
+    size_t m = ondemand_select(projection, depth, active, n, key, 0, selected);
+    // The key is interned before the scratch arena it may be decoded into
+    // is reused below.
+    json_key *interned =
+        m ? key_table_intern(projection->keys, key.data, key.length) : NULL;
+    arena_reset(&doc->scratch);
+    if (m && !interned)
+      return false;
+
+    json_value *child = NULL;
+    if (!m)
+      i = ondemand_skip(doc, i + 2);
+    else if (!ondemand_project(projection, i + 2, depth + 1, selected, m,
+                               false, &i, &child))
+      return false;
+
+    if (child) {
+      if (!*value && !(*value = ondemand_container(projection->arena, DICT)))
+        return false;
+      if (!hash_map_add_interned(map_value_get_data(*value).ptr, interned,
+                                 child))
+        return false;
+    }
+    if (i >= count || ondemand_char(doc, i) != ',')
+      break;
+    i++;
+  }
+
+  if (i >= count || ondemand_char(doc, i) != '}') {
+    LOG_ERROR("Malformed object at offset %" PRIu32,
+              doc->index.positions[start]);
+    return false;
+  }
+  *next = i + 1;
+  return true;
+}
+
+// Elements that are not selected but come before one that is are kept as
+// null, so every selected element stays at its index.
+static bool ondemand_project_array(ondemand_projection *projection, uint64_t i,
+                                   uint32_t depth, const uint32_t *active,
+                                   size_t n, uint64_t *next,
+                                   json_value **value) {
+  json_ondemand *doc = projection->doc;
+  uint64_t count = doc->index.count;
+  uint64_t start = i;
+  uint32_t *selected = projection->active + (depth + 1) * projection->count;
+  uint64_t nulls = 0;
+
+  i++;
+  for (uint64_t index = 0; ondemand_is_value(doc, i); index++) {
+    size_t m = ondemand_select(projection, depth, active, n, (json_text){},
+                               index, selected);
+    json_value *child = NULL;
+    if (!m)
+      i = ondemand_skip(doc, i);
+    else if (!ondemand_project(projection, i, depth + 1, selected, m, false,
+                               &i, &child))
+      return false;
+
+    if (child) {
+      if (!*value && !(*value = ondemand_container(projection->arena, LIST)))
+        return false;
+      array_t *array = map_value_get_data(*value).ptr;
+      map_value null;
+      if (!map_value_make(projection->arena, NULLS, (json_data){}, 0, &null))
+        return false;
+      for (; nulls; nulls--)
+        array_append_xxx(array, &null);
+      array_append_xxx(array, child);
+    } else {
+      nulls++;
+    }
+    if (i >= count || ondemand_char(doc, i) != ',')
+      break;
+    i++;
+  }
+
+  if (i >= count || ondemand_char(doc, i) != ']') {
+    LOG_ERROR("Malformed array at offset %" PRIu32,
+              doc->index.positions[start]);
+    return false;
+  }
+  *next = i + 1;
+  return true;
+}
+
+// Keeps what the active paths, which have taken depth steps to reach the
+// value at i, select below it. A path that ends here takes the whole value.
+// *value is left NULL when nothing is selected, unless keep asks for the
+// container anyway; *next is set past the value.
+static bool ondemand_project(ondemand_projection *projection, uint64_t i,
+                             uint32_t depth, const uint32_t *active, size_t n,
+                             bool keep, uint64_t *next, json_value **value) {
+  json_ondemand *doc = projection->doc;
+  *value = NULL;
+  for (size_t k = 0; k < n; k++) {
+    if (projection->paths[active[k]]->length == depth) {
+      *next = ondemand_skip(doc, i);
+      *value = ondemand_build(doc, i, *next, projection->arena,
+                              projection->keys);
+      return *value != NULL;
+    }
+  }
+
+  char c = ondemand_char(doc, i);
+  if (c != '{' && c != '[') {
+    *next = i + 1;
+    return true;
+  }
+  if (keep && !(*value = ondemand_container(projection->arena,
+                                            c == '{' ? DICT : LIST)))
+    return false;
+  if (c == '{')
+    return ondemand_project_object(projection, i, depth, active, n, next,
+                                   value);
+  return ondemand_project_array(projection, i, depth, active, n, next, value);
+}
+
+// Builds the root with only what paths select into arena, interning every
+// object key in keys as a document parse does. Members and elements that no
+// path selects are skipped over the index without being read. A container
+// root is kept even if nothing in it is selected and a scalar root is kept
+// whole.
+json_value *json_ondemand_project(json_ondemand *doc, json_path *const *paths,
+                                  size_t count, json_arena *arena,
+                                  hash_map *keys) {
+  uint32_t depth = 0;
+  for (size_t k = 0; k < count; k++)
+    if (paths[k]->length > depth)
+      depth = paths[k]->length;
+
+  ondemand_projection projection = {
+      .doc = doc, .paths = paths, .count = count, .arena = arena, .keys = keys};
+  projection.active = zmalloc(((size_t)depth + 1) * (count ? count : 1) *
+                              sizeof(*projection.active));
+  if (!projection.active) {
+    LOG_ERROR("Failed to allocate projection state");
+    return NULL;
+  }
+  for (size_t k = 0; k < count; k++)
+    projection.active[k] = k;
+
+  uint64_t next;
+  json_value *root;
+  bool projected = ondemand_project(&projection, 0, 0, projection.active,
+                                    count, true, &next, &root);
+  zfree(projection.active);
+  if (!projected)
+    return NULL;
+  if (next < doc->index.count) {
+    LOG_ERROR("Unexpected content after the root at offset %" PRIu32,
+              doc->index.positions[next]);
+    return NULL;
+  }
+  return root ? root : ondemand_build(doc, 0, next, arena, keys);
+}
@@ -0,0 +1,254 @@
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+#include "ison_data.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define JSON_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define JSON_PREFETCH(address) ((void)(address))
+#endif
+
+// Documents json_path_eval_many advances together, one step at a time, so
+// the memory the next step of one document reads is being fetched while
+// the others are evaluated.
+#define PATH_BATCH 8
+
+// Parses source into steps. With out NULL only the steps and key bytes are
+// counted; the second pass writes them into out, whose key area follows
+// its steps.
+static bool path_parse(const char *source, json_path *out, uint32_t *length,
+                       size_t *key_bytes) {
+  const char *c = source;
+  char *keys = out ? (char *)(out->steps + out->length) : NULL;
+  *length = 0;
+  *key_bytes = 0;
+
+  if (*c == '$')
+    c++;
+  bool first = true;
+  while (*c) {
+    json_path_step step = {.kind = PATH_KEY};
+    const char *key = NULL;
+    size_t key_len = 0;
+    bool escaped = false;
+
+    if (*c == '[') {
+      c++;
+      if (*c == '*') {
+        step.kind = PATH_WILDCARD;
+        c++;
+      } else if (*c == '\'' || *c == '"') {
+        char quote = *c++;
+        key = c;
+        while (*c && *c != quote) {
+          if (*c == '\\' && c[1]) {
+            escaped = true;
+            c++;
+          }
+          c++;
+          key_len++;
+        }
+        if (*c++ != quote)
+          goto error;
+      } else if (*c >= '0' && *c <= '9') {
+        step.kind = PATH_INDEX;
+        for (; *c >= '0' && *c <= '9'; c++) {
+          if (step.index > (UINT64_MAX - (*c - '0')) / 10)
+            goto error;
+          step.index = step.index * 10 + (*c - '0');
+        }
+      } else {
+        goto error;
+      }
+      if (*c++ != ']')
+        goto error;
+    } else {
+      if (*c == '.')
+        c++;
+      else if (!first)
+        goto error;
+      if (*c == '*' && (!c[1] || c[1] == '.' || c[1] == '[')) {
+        step.kind = PATH_WILDCARD;
+        c++;
+      } else {
+        key = c;
+        while (*c && *c != '.' && *c != '[')
+          c++;
+        key_len = c - key;
+        if (!key_len)
+          goto error;
+      }
+    }
+    first = false;
+
+    if (step.kind == PATH_KEY) {
+      if (key_len > UINT32_MAX)
+        goto error;
+      step.key_len = key_len;
+      if (out) {
+        // Quoted keys drop the backslash of every escape.
+        char *copy = keys + *key_bytes;
+        for (size_t i = 0; i < key_len; i++) {
+          if (escaped && *key == '\\')
+            key++;
+          copy[i] = *key++;
+        }
+        step.key = copy;
+      }
+      *key_bytes += key_len;
+    }
+    if (out) {
+      out->steps[*length] = step;
+      out->has_wildcard |= step.kind == PATH_WILDCARD;
+    }
+    if (*length == UINT32_MAX)
+      goto error;
+    (*length)++;
+  }
+  return true;
+
+error:
+  LOG_ERROR("Invalid path \"%s\" at offset %zu", source, (size_t)(c - source));
+  return false;
+}
+
+json_path *json_path_compile(const char *source) {
+  if (!source) {
+    LOG_ERROR("Received NULL path");
+    return NULL;
+  }
+
+  uint32_t length;
+  size_t key_bytes;
+  if (!path_parse(source, NULL, &length, &key_bytes))
+    return NULL;
+
+  json_path *path =
+      zcalloc(1, sizeof(*path) + length * sizeof(json_path_step) + key_bytes);
+  if (!path) {
+    LOG_ERROR("Failed to allocate path");
+    return NULL;
+  }
+  path->length = length;
+  path_parse(source, path, &length, &key_bytes);
+  return path;
+}
+
+void json_path_free(json_path *path) { zfree(path); }
+
+// Starts loading the container node refers to, which the next step reads.
+static inline void path_prefetch(json_value *node) {
+  map_value_type type = map_value_get_type(node);
+  if (type == DICT || type == LIST)
+    JSON_PREFETCH(map_value_get_data(node).ptr);
+}
+
+// Applies a key or index step; wildcards are expanded by path_visit.
+static json_value *path_step(json_value *node, const json_path_step *step) {
+  if (step->kind == PATH_KEY)
+    return json_query_n(node, step->key, step->key_len);
+
+  if (map_value_get_type(node) != LIST)
+    return NULL;
+  array_t *array = map_value_get_data(node).ptr;
+  if (step->index >= array_length(array) || step->index > INT32_MAX)
+    return NULL;
+  return array_get(array, step->index);
+}
+
+// Reports every match of the steps of path from step on below node.
+// Returns false once the callback stops the walk.
+static bool path_visit(json_value *node, const json_path *path, uint32_t step,
+                       size_t doc, json_path_callback callback, void *ctx) {
+  for (; step < path->length; step++) {
+    if (path->steps[step].kind != PATH_WILDCARD) {
+      node = path_step(node, &path->steps[step]);
+      if (!node)
+        return true;
+      continue;
+    }
+
+    map_value_type type = map_value_get_type(node);
+    json_value *child;
+    if (type == LIST) {
+      array_t *array = map_value_get_data(node).ptr;
+      uint64_t length = array_length(array);
+      for (uint64_t i = 0; i < length && i <= INT32_MAX; i++) {
+        child = array_get(array, i);
+        if (!path_visit(child, path, step + 1, doc, callback, ctx))
+          return false;
+      }
+    } else if (type == DICT) {
+      uint64_t cursor = 0;
+      while ((child = hash_map_next_value(map_value_get_data(node).ptr,
+                                          &cursor)))
+        if (!path_visit(child, path, step + 1, doc, callback, ctx))
+          return false;
+    }
+    return true;
+  }
+  return callback(ctx, doc, node);
+}
+
+static bool path_first_match(void *ctx, size_t doc, json_value *value) {
+  (void)doc;
+  *(json_value **)ctx = value;
+  return false;
+}
+
+json_value *json_path_eval(json_value *root, const json_path *path) {
+  if (!root || !path)
+    return NULL;
+
+  json_value *match = NULL;
+  path_visit(root, path, 0, 0, path_first_match, &match);
+  return match;
+}
+
+// Paths without wildcards have at most one match per document and are run
+// over PATH_BATCH documents in lockstep, prefetching the container each of
+// them reads next. Others are walked one document at a time with the next
+// root prefetched.
+bool json_path_eval_many(json_value *const *roots, size_t count,
+                         const json_path *path, json_path_callback callback,
+                         void *ctx) {
+  if (!roots || !path || !callback) {
+    LOG_ERROR("Received NULL roots, path or callback");
+    return false;
+  }
+
+  if (path->has_wildcard) {
+    for (size_t i = 0; i < count; i++) {
+      if (i + 1 < count && roots[i + 1])
+        JSON_PREFETCH(roots[i + 1]);
+      if (roots[i] && !path_visit(roots[i], path, 0, i, callback, ctx))
+        return false;
+    }
+    return true;
+  }
+
+  json_value *nodes[PATH_BATCH];
+  for (size_t base = 0; base < count; base += PATH_BATCH) {
+    size_t batch = count - base < PATH_BATCH ? count - base : PATH_BATCH;
+    for (size_t j = 0; j < batch; j++) {
+      nodes[j] = roots[base + j];
+      if (nodes[j])
+        JSON_PREFETCH(nodes[j]);
+    }
+    for (uint32_t step = 0; step < path->length; step++) {
+      for (size_t j = 0; j < batch; j++) {
+        if (!nodes[j])
+          continue;
+        nodes[j] = path_step(nodes[j], &path->steps[step]);
+        if (nodes[j])
+          path_prefetch(nodes[j]);
+      }
+    }
+    for (size_t j = 0; j < batch; j++)
+      if (nodes[j] && !callback(ctx, base + j, nodes[j]))
+        return false;
+  }
+  return true;
+}
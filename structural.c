@@ -0,0 +1,327 @@
+#include "structural.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zot.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISON_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define ISON_NEON_KERNEL
+#include <arm_neon.h>
+#endif
+
+enum char_class_bits {
+  CLASS_QUOTE = 1 << 0,
+  CLASS_BACKSLASH = 1 << 1,
+  CLASS_STRUCTURAL = 1 << 2,
+  CLASS_WHITESPACE = 1 << 3,
+  CLASS_CONTROL = 1 << 4,
+  CLASS_SLASH = 1 << 5,
+};
+
+static uint8_t char_class[256];
+
+static void classify_block_scalar(const char *block, json_block_class *out) {
+  json_block_class classes = {0};
+  for (int i = 0; i < JSON_BLOCK_SIZE; i++) {
+    uint8_t class = char_class[(uint8_t)block[i]];
+    uint64_t bit = 1ULL << i;
+    if (class & CLASS_QUOTE)
+      classes.quote |= bit;
+    if (class & CLASS_BACKSLASH)
+      classes.backslash |= bit;
+    if (class & CLASS_STRUCTURAL)
+      classes.structural |= bit;
+    if (class & CLASS_WHITESPACE)
+      classes.whitespace |= bit;
+    if (class & CLASS_CONTROL)
+      classes.control |= bit;
+    if (class & CLASS_SLASH)
+      classes.slash |= bit;
+  }
+  *out = classes;
+}
+
+#ifdef ISON_X86_KERNELS
+__attribute__((target("sse4.2"))) static void
+classify_block_sse42(const char *block, json_block_class *out) {
+  json_block_class classes = {0};
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+    // Setting bit 0x20 folds '[' onto '{' and ']' onto '}'.
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    __m128i backslash = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+    __m128i structural = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+    __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    __m128i control =
+        _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+
+    int shift = 16 * i;
+    classes.quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(quote) << shift;
+    classes.backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(backslash)
+                         << shift;
+    classes.structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(structural)
+                          << shift;
+    classes.whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(whitespace)
+                          << shift;
+    classes.control |= (uint64_t)(uint16_t)_mm_movemask_epi8(control) << shift;
+    classes.slash |= (uint64_t)(uint16_t)_mm_movemask_epi8(slash) << shift;
+  }
+  *out = classes;
+}
+
+__attribute__((target("avx2"))) static void
+classify_block_avx2(const char *block, json_block_class *out) {
+  json_block_class classes = {0};
+  for (int i = 0; i < 2; i++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+    __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+    __m256i backslash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+    __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+    __m256i structural = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                        _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+    __m256i whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    __m256i control =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+
+    int shift = 32 * i;
+    classes.quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(quote) << shift;
+    classes.backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(backslash)
+                         << shift;
+    classes.structural |=
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(structural) << shift;
+    classes.whitespace |=
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(whitespace) << shift;
+    classes.control |= (uint64_t)(uint32_t)_mm256_movemask_epi8(control)
+                       << shift;
+    classes.slash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(slash) << shift;
+  }
+  *out = classes;
+}
+#endif
+
+#ifdef ISON_NEON_KERNEL
+static inline uint16_t neon_movemask(uint8x16_t v) {
+  const uint8x16_t weights = {1, 2, 4, 8, 16, 32, 64, 128,
+                              1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t masked = vandq_u8(v, weights);
+#ifdef __aarch64__
+  return vaddv_u8(vget_low_u8(masked)) |
+         (uint16_t)(vaddv_u8(vget_high_u8(masked)) << 8);
+#else
+  uint8x8_t sum = vpadd_u8(vget_low_u8(masked), vget_high_u8(masked));
+  sum = vpadd_u8(sum, sum);
+  sum = vpadd_u8(sum, sum);
+  return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+#endif
+}
+
+static void classify_block_neon(const char *block, json_block_class *out) {
+  json_block_class classes = {0};
+  for (int i = 0; i < 4; i++) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)block + 16 * i);
+    uint8x16_t folded = vorrq_u8(v, vdupq_n_u8(0x20));
+    uint8x16_t quote = vceqq_u8(v, vdupq_n_u8('"'));
+    uint8x16_t backslash = vceqq_u8(v, vdupq_n_u8('\\'));
+    uint8x16_t slash = vceqq_u8(v, vdupq_n_u8('/'));
+    uint8x16_t structural =
+        vorrq_u8(vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')),
+                          vceqq_u8(folded, vdupq_n_u8('}'))),
+                 vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                          vceqq_u8(v, vdupq_n_u8(','))));
+    uint8x16_t whitespace =
+        vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                          vceqq_u8(v, vdupq_n_u8('\t'))),
+                 vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                          vceqq_u8(v, vdupq_n_u8('\r'))));
+    uint8x16_t control = vcltq_u8(v, vdupq_n_u8(0x20));
+
+    int shift = 16 * i;
+    classes.quote |= (uint64_t)neon_movemask(quote) << shift;
+    classes.backslash |= (uint64_t)neon_movemask(backslash) << shift;
+    classes.structural |= (uint64_t)neon_movemask(structural) << shift;
+    classes.whitespace |= (uint64_t)neon_movemask(whitespace) << shift;
+    classes.control |= (uint64_t)neon_movemask(control) << shift;
+    classes.slash |= (uint64_t)neon_movemask(slash) << shift;
+  }
+  *out = classes;
+}
+#endif
+
+static void (*classify_block)(const char *, json_block_class *) =
+    classify_block_scalar;
+
+static void __attribute__((__constructor__)) init_structural_kernels() {
+  for (int c = 0; c < 0x20; c++)
+    char_class[c] |= CLASS_CONTROL;
+  char_class['"'] |= CLASS_QUOTE;
+  char_class['\\'] |= CLASS_BACKSLASH;
+  char_class['/'] |= CLASS_SLASH;
+  for (const char *s = "{}[]:,"; *s; s++)
+    char_class[(uint8_t)*s] |= CLASS_STRUCTURAL;
+  for (const char *s = " \t\n\r"; *s; s++)
+    char_class[(uint8_t)*s] |= CLASS_WHITESPACE;
+
+#if defined(ISON_NEON_KERNEL)
+  classify_block = classify_block_neon;
+#elif defined(ISON_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    classify_block = classify_block_avx2;
+  else if (__builtin_cpu_supports("sse4.2"))
+    classify_block = classify_block_sse42;
+#endif
+}
+
+void json_classify_block(const char *block, json_block_class *classes) {
+  classify_block(block, classes);
+}
+
+// Length of the run starting at c that a string literal can copy verbatim,
+// i.e. up to the next quote, backslash or control character.
+size_t json_scan_string_run(const char *c, const char *end) {
+  const char *start = c;
+  while (end - c >= JSON_BLOCK_SIZE) {
+    json_block_class classes;
+    classify_block(c, &classes);
+    uint64_t stop = classes.quote | classes.backslash | classes.control;
+    if (stop)
+      return c - start + __builtin_ctzll(stop);
+    c += JSON_BLOCK_SIZE;
+  }
+  while (c < end &&
+         !(char_class[(uint8_t)*c] & (CLASS_QUOTE | CLASS_BACKSLASH |
+                                      CLASS_CONTROL)))
+    c++;
+  return c - start;
+}
+
+static inline uint64_t prefix_xor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+// Marks the characters escaped by an odd-length run of backslashes, carrying
+// a run that crosses the block boundary over in *prev_escaped.
+static inline uint64_t find_escaped(uint64_t backslash,
+                                    uint64_t *prev_escaped) {
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  backslash &= ~*prev_escaped;
+  uint64_t follows_escape = backslash << 1 | *prev_escaped;
+  uint64_t odd_sequence_starts = backslash & ~even_bits & ~follows_escape;
+  uint64_t sequences_starting_on_even_bits;
+  *prev_escaped = __builtin_add_overflow(odd_sequence_starts, backslash,
+                                         &sequences_starting_on_even_bits);
+  uint64_t invert_mask = sequences_starting_on_even_bits << 1;
+  return (even_bits ^ invert_mask) & follows_escape;
+}
+
+static bool structural_index_reserve(json_structural_index *index,
+                                     uint64_t extra) {
+  if (index->count + extra <= index->capacity)
+    return true;
+  uint64_t capacity = index->capacity ? index->capacity * 2 : 1024;
+  while (capacity < index->count + extra)
+    capacity *= 2;
+  void *tmp = index->positions
+                  ? zrealloc(index->positions,
+                             capacity * sizeof(*index->positions))
+                  : zmalloc(capacity * sizeof(*index->positions));
+  if (!tmp) {
+    LOG_ERROR("Failed to allocate structural index of %" PRIu64 " entries",
+              capacity);
+    return false;
+  }
+  index->positions = tmp;
+  index->capacity = capacity;
+  return true;
+}
+
+bool json_structural_index_build(const char *buf, size_t len,
+                                 json_structural_index *index) {
+  if (len > UINT32_MAX) {
+    LOG_ERROR("Input of %zu bytes is too large to index", len);
+    return false;
+  }
+
+  uint64_t prev_escaped = 0;
+  uint64_t prev_in_string = 0;
+  uint64_t prev_scalar = 0;
+  index->count = 0;
+  index->has_comments = false;
+
+  for (size_t offset = 0; offset < len; offset += JSON_BLOCK_SIZE) {
+    const char *block = buf + offset;
+    char tail[JSON_BLOCK_SIZE];
+    if (len - offset < JSON_BLOCK_SIZE) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, len - offset);
+      block = tail;
+    }
+
+    json_block_class classes;
+    classify_block(block, &classes);
+
+    uint64_t escaped = find_escaped(classes.backslash, &prev_escaped);
+    uint64_t quote = classes.quote & ~escaped;
+    // Set from an opening quote up to, but excluding, its closing quote.
+    uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
+    prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    uint64_t outside = ~in_string;
+    uint64_t scalar =
+        outside & ~(classes.structural | classes.whitespace | quote);
+    uint64_t scalar_start = scalar & ~(scalar << 1 | prev_scalar);
+    prev_scalar = scalar >> 63;
+
+    uint64_t starts = (classes.structural & outside) | (quote & in_string) |
+                      scalar_start;
+    // A slash outside a string can only open a comment, wherever it stands,
+    // and brackets inside comments make the index unusable.
+    if (classes.slash & outside)
+      index->has_comments = true;
+
+    if (!structural_index_reserve(index, __builtin_popcountll(starts)))
+      return false;
+    while (starts) {
+      uint32_t position = offset + __builtin_ctzll(starts);
+      index->positions[index->count++] = position;
+      starts &= starts - 1;
+    }
+  }
+
+  return true;
+}
+
+void json_structural_index_release(json_structural_index *index) {
+  if (index->positions)
+    zfree(index->positions);
+  memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,34 @@
+#ifndef STRUCTURAL_H
+#define STRUCTURAL_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define JSON_BLOCK_SIZE 64
+
+// One bit per byte of a 64-byte block, bit i describing block[i].
+typedef struct json_block_class {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t structural;
+  uint64_t whitespace;
+  uint64_t control;
+  uint64_t slash;
+} json_block_class;
+
+// Offsets of every structural character, opening quote and scalar start that
+// lies outside a string, in input order.
+typedef struct json_structural_index {
+  uint32_t *positions;
+  uint64_t count;
+  uint64_t capacity;
+  bool has_comments;
+} json_structural_index;
+
+void json_classify_block(const char *block, json_block_class *classes);
+size_t json_scan_string_run(const char *c, const char *end);
+bool json_structural_index_build(const char *buf, size_t len,
+                                 json_structural_index *index);
+void json_structural_index_release(json_structural_index *index);
+
+#endif
@@ -0,0 +1,389 @@
+#include <string.h>
+#include <zot.h>
+
+#include "ds.h"
+
+// Every entry of the tape is one 64-bit word: a tag in the top byte and a
+// payload below it. Scalars that need all 64 bits take a second word.
+#define TAPE_TAG_SHIFT 56
+#define TAPE_PAYLOAD_MASK ((1ULL << TAPE_TAG_SHIFT) - 1)
+// A container start keeps the index just past its end in the low 32 bits
+// and its element count, saturated, in the 24 bits above.
+#define TAPE_END_MASK 0xffffffffULL
+#define TAPE_COUNT_SHIFT 32
+#define TAPE_COUNT_MAX 0xffffffULL
+#define TAPE_INITIAL_WORDS 64
+#define TAPE_INITIAL_STRINGS 256
+#define TAPE_INITIAL_DEPTH 32
+
+enum json_tape_tag {
+  TAPE_OBJECT_START = '{',
+  TAPE_OBJECT_END = '}',
+  TAPE_ARRAY_START = '[',
+  TAPE_ARRAY_END = ']',
+  // Payload: offset of the string in the string area, where a uint32_t
+  // length precedes the NUL-terminated bytes.
+  TAPE_STRING = '"',
+  // The value follows in the next word.
+  TAPE_INTEGER = 'l',
+  TAPE_DOUBLE = 'd',
+  TAPE_TRUE = 't',
+  TAPE_FALSE = 'f',
+  TAPE_NULL = 'n'
+};
+
+// The whole document is this one block: the words, then the strings.
+struct json_tape {
+  uint64_t length;
+  uint64_t words[];
+};
+
+typedef struct tape_builder {
+  uint64_t *words;
+  uint64_t length;
+  uint64_t capacity;
+  char *strings;
+  size_t strings_length;
+  size_t strings_capacity;
+  // Start words of the open containers, innermost last.
+  uint64_t *open;
+  uint32_t depth;
+  uint32_t open_capacity;
+} tape_builder;
+
+static inline uint64_t tape_word(enum json_tape_tag tag, uint64_t payload) {
+  return (uint64_t)tag << TAPE_TAG_SHIFT | payload;
+}
+
+static inline enum json_tape_tag tape_tag(uint64_t word) {
+  return word >> TAPE_TAG_SHIFT;
+}
+
+static bool tape_append(tape_builder *tape, uint64_t word) {
+  if (tape->length == tape->capacity) {
+    uint64_t capacity =
+        tape->capacity ? tape->capacity * 2 : TAPE_INITIAL_WORDS;
+    if (capacity > TAPE_END_MASK) {
+      LOG_ERROR("Document is too large for a tape");
+      return false;
+    }
+    uint64_t *words = zrealloc(tape->words, capacity * sizeof(*words));
+    if (!words) {
+      LOG_ERROR("Failed to grow tape to %" PRIu64 " words", capacity);
+      return false;
+    }
+    tape->words = words;
+    tape->capacity = capacity;
+  }
+  tape->words[tape->length++] = word;
+  return true;
+}
+
+// Counts an element of the innermost container if it is of the given kind:
+// arrays count their values, objects their keys.
+static void tape_count(tape_builder *tape, enum json_tape_tag container) {
+  if (!tape->depth)
+    return;
+  uint64_t *start = &tape->words[tape->open[tape->depth - 1]];
+  if (tape_tag(*start) == container &&
+      (*start >> TAPE_COUNT_SHIFT & TAPE_COUNT_MAX) < TAPE_COUNT_MAX)
+    *start += 1ULL << TAPE_COUNT_SHIFT;
+}
+
+static bool tape_scalar(tape_builder *tape, enum json_tape_tag tag) {
+  tape_count(tape, TAPE_ARRAY_START);
+  return tape_append(tape, tape_word(tag, 0));
+}
+
+static bool tape_string(tape_builder *tape, const char *str, size_t len) {
+  if (len > UINT32_MAX) {
+    LOG_ERROR("String of %zu bytes is too long for a tape", len);
+    return false;
+  }
+  size_t needed = tape->strings_length + sizeof(uint32_t) + len + 1;
+  if (needed > tape->strings_capacity) {
+    size_t capacity = tape->strings_capacity ? tape->strings_capacity
+                                             : TAPE_INITIAL_STRINGS;
+    while (capacity < needed)
+      capacity *= 2;
+    char *strings = zrealloc(tape->strings, capacity);
+    if (!strings) {
+      LOG_ERROR("Failed to grow tape strings to %zu bytes", capacity);
+      return false;
+    }
+    tape->strings = strings;
+    tape->strings_capacity = capacity;
+  }
+
+  size_t offset = tape->strings_length;
+  uint32_t length = len;
+  memcpy(tape->strings + offset, &length, sizeof(length));
+  memcpy(tape->strings + offset + sizeof(length), str, len);
+  tape->strings[offset + sizeof(length) + len] = 0;
+  tape->strings_length = needed;
+  return tape_append(tape, tape_word(TAPE_STRING, offset));
+}
+
+static bool tape_open(tape_builder *tape, enum json_tape_tag tag) {
+  tape_count(tape, TAPE_ARRAY_START);
+  if (tape->depth == tape->open_capacity) {
+    uint32_t capacity =
+        tape->open_capacity ? tape->open_capacity * 2 : TAPE_INITIAL_DEPTH;
+    uint64_t *open = zrealloc(tape->open, capacity * sizeof(*open));
+    if (!open) {
+      LOG_ERROR("Failed to grow tape stack to %" PRIu32 " entries",
+                capacity);
+      return false;
+    }
+    tape->open = open;
+    tape->open_capacity = capacity;
+  }
+  tape->open[tape->depth++] = tape->length;
+  return tape_append(tape, tape_word(tag, 0));
+}
+
+// Links both ends: the start learns where the container ends, so skipping it
+// takes one step, and the end points back at the start.
+static bool tape_close(tape_builder *tape, enum json_tape_tag tag) {
+  uint64_t start = tape->open[--tape->depth];
+  if (!tape_append(tape, tape_word(tag, start)))
+    return false;
+  tape->words[start] |= tape->length;
+  return true;
+}
+
+static bool tape_object_start(void *ctx) {
+  return tape_open(ctx, TAPE_OBJECT_START);
+}
+
+static bool tape_object_end(void *ctx) {
+  return tape_close(ctx, TAPE_OBJECT_END);
+}
+
+static bool tape_array_start(void *ctx) {
+  return tape_open(ctx, TAPE_ARRAY_START);
+}
+
+static bool tape_array_end(void *ctx) {
+  return tape_close(ctx, TAPE_ARRAY_END);
+}
+
+static bool tape_key(void *ctx, const char *key, size_t len) {
+  tape_count(ctx, TAPE_OBJECT_START);
+  return tape_string(ctx, key, len);
+}
+
+static bool tape_string_value(void *ctx, const char *str, size_t len) {
+  tape_count(ctx, TAPE_ARRAY_START);
+  return tape_string(ctx, str, len);
+}
+
+static bool tape_integer(void *ctx, int64_t integer) {
+  return tape_scalar(ctx, TAPE_INTEGER) &&
+         tape_append(ctx, (uint64_t)integer);
+}
+
+static bool tape_number(void *ctx, double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return tape_scalar(ctx, TAPE_DOUBLE) && tape_append(ctx, bits);
+}
+
+static bool tape_boolean(void *ctx, bool boolean) {
+  return tape_scalar(ctx, boolean ? TAPE_TRUE : TAPE_FALSE);
+}
+
+static bool tape_null(void *ctx) { return tape_scalar(ctx, TAPE_NULL); }
+
+static const json_handler tape_handler = {
+    .object_start = tape_object_start,
+    .object_end = tape_object_end,
+    .array_start = tape_array_start,
+    .array_end = tape_array_end,
+    .key = tape_key,
+    .string = tape_string_value,
+    .integer = tape_integer,
+    .number = tape_number,
+    .boolean = tape_boolean,
+    .null = tape_null,
+};
+
+// Records the document through the event parser, then moves words and
+// strings into a single block sized to fit.
+json_tape *json_parse_tape(const char *str, size_t len) {
+  tape_builder builder = {0};
+  json_tape *tape = NULL;
+  if (json_parse_events(str, len, &tape_handler, &builder)) {
+    size_t words = builder.length * sizeof(*builder.words);
+    tape = zmalloc(sizeof(*tape) + words + builder.strings_length);
+    if (tape) {
+      tape->length = builder.length;
+      memcpy(tape->words, builder.words, words);
+      if (builder.strings_length)
+        memcpy(&tape->words[tape->length], builder.strings,
+               builder.strings_length);
+    } else {
+      LOG_ERROR("Failed to allocate tape");
+    }
+  }
+  zfree(builder.words);
+  zfree(builder.strings);
+  zfree(builder.open);
+  return tape;
+}
+
+void json_tape_free(json_tape *tape) {
+  if (tape)
+    zfree(tape);
+}
+
+json_tape_iter json_tape_root(const json_tape *tape) {
+  return (json_tape_iter){.tape = tape, .index = 0};
+}
+
+map_value_type json_tape_type(json_tape_iter it) {
+  if (!it.tape || it.index >= it.tape->length)
+    return UNKNOWN;
+  switch (tape_tag(it.tape->words[it.index])) {
+  case TAPE_OBJECT_START:
+    return DICT;
+  case TAPE_ARRAY_START:
+    return LIST;
+  case TAPE_STRING:
+    return TEXT;
+  case TAPE_INTEGER:
+    return INTEGERS;
+  case TAPE_DOUBLE:
+    return FLOATS;
+  case TAPE_TRUE:
+  case TAPE_FALSE:
+    return BOOLEANS;
+  case TAPE_NULL:
+    return NULLS;
+  default:
+    return UNKNOWN;
+  }
+}
+
+// Index of the word after the value at index; containers are skipped in one
+// step through their end link.
+static uint64_t tape_skip(const json_tape *tape, uint64_t index) {
+  uint64_t word = tape->words[index];
+  switch (tape_tag(word)) {
+  case TAPE_OBJECT_START:
+  case TAPE_ARRAY_START:
+    return word & TAPE_END_MASK;
+  case TAPE_INTEGER:
+  case TAPE_DOUBLE:
+    return index + 2;
+  default:
+    return index + 1;
+  }
+}
+
+static inline uint64_t tape_stored_count(json_tape_iter it) {
+  return it.tape->words[it.index] >> TAPE_COUNT_SHIFT & TAPE_COUNT_MAX;
+}
+
+// A saturated count says only that there are at least TAPE_COUNT_MAX
+// children, so they are counted by walking the container.
+size_t json_tape_length(json_tape_iter it) {
+  map_value_type type = json_tape_type(it);
+  if (type != DICT && type != LIST)
+    return 0;
+  uint64_t count = tape_stored_count(it);
+  if (count < TAPE_COUNT_MAX)
+    return count;
+
+  json_tape_iter child;
+  json_tape_child(it, &child);
+  for (count = 1; json_tape_next(&child); count++)
+    ;
+  return count;
+}
+
+// In an object the iterator visits the member values; each key sits in the
+// word just before its value.
+bool json_tape_child(json_tape_iter container, json_tape_iter *child) {
+  map_value_type type = json_tape_type(container);
+  if ((type != DICT && type != LIST) || !tape_stored_count(container))
+    return false;
+  *child = (json_tape_iter){.tape = container.tape,
+                            .index = container.index + 1 + (type == DICT),
+                            .member = type == DICT};
+  return true;
+}
+
+bool json_tape_next(json_tape_iter *it) {
+  if (!it->tape || it->index >= it->tape->length)
+    return false;
+  uint64_t next = tape_skip(it->tape, it->index);
+  if (next >= it->tape->length)
+    return false;
+  enum json_tape_tag tag = tape_tag(it->tape->words[next]);
+  if (tag == TAPE_OBJECT_END || tag == TAPE_ARRAY_END)
+    return false;
+  it->index = next + it->member;
+  return true;
+}
+
+static json_text tape_text(const json_tape *tape, uint64_t word) {
+  const char *strings = (const char *)&tape->words[tape->length];
+  const char *entry = strings + (word & TAPE_PAYLOAD_MASK);
+  uint32_t length;
+  memcpy(&length, entry, sizeof(length));
+  return (json_text){.data = entry + sizeof(length), .length = length};
+}
+
+json_text json_tape_key(json_tape_iter it) {
+  if (!it.member)
+    return (json_text){0};
+  return tape_text(it.tape, it.tape->words[it.index - 1]);
+}
+
+bool json_tape_find(json_tape_iter object, const char *key, size_t key_len,
+                    json_tape_iter *value) {
+  if (json_tape_type(object) != DICT)
+    return false;
+  json_tape_iter it;
+  for (bool more = json_tape_child(object, &it); more;
+       more = json_tape_next(&it)) {
+    json_text text = json_tape_key(it);
+    if (text.length == key_len && !memcmp(text.data, key, key_len)) {
+      *value = it;
+      return true;
+    }
+  }
+  return false;
+}
+
+json_text json_tape_text(json_tape_iter it) {
+  if (json_tape_type(it) != TEXT)
+    return (json_text){0};
+  return tape_text(it.tape, it.tape->words[it.index]);
+}
+
+bool json_tape_int64(json_tape_iter it, int64_t *integer) {
+  if (json_tape_type(it) != INTEGERS)
+    return false;
+  *integer = (int64_t)it.tape->words[it.index + 1];
+  return true;
+}
+
+bool json_tape_double(json_tape_iter it, double *number) {
+  map_value_type type = json_tape_type(it);
+  if (type == INTEGERS)
+    *number = (double)(int64_t)it.tape->words[it.index + 1];
+  else if (type == FLOATS)
+    memcpy(number, &it.tape->words[it.index + 1], sizeof(*number));
+  else
+    return false;
+  return true;
+}
+
+bool json_tape_bool(json_tape_iter it, bool *boolean) {
+  if (json_tape_type(it) != BOOLEANS)
+    return false;
+  *boolean = tape_tag(it.tape->words[it.index]) == TAPE_TRUE;
+  return true;
+}